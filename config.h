@@ -12,21 +12,47 @@
 #define ANALOG_KEY_VIRTUAL_AXES
 // enable processing of DKS - only works for 16 cols
 #define DKS_ENABLE
+// enable guided calibration - the CALIBRATE keycode (or Vial) captures the rest and
+// bottom-out of every key pressed fully once, and saves the travel of each key
+// #define ANALOG_CALIBRATION_MODE
+
+// enable continuous acquisition - ADCs run in circular DMA mode and the
+// multiplexer is stepped from the ADC callbacks, the scan loop only reads finished frames
+// #define ADC_CIRCULAR_DMA
+// enable hardware paced acquisition - a timer triggers the ADCs and DMA writes the multiplexer select pins
+// #define ADC_TIMER_TRIGGER
+// enable dual mode - ADC1/ADC2 and ADC3/ADC4 run as master/slave pairs in regular simultaneous mode
+// #define ADC_DUAL_MODE
+// enable runtime sampling time and resolution - each ADC is tuned to the fastest
+// sampling time which meets ADC_NOISE_TARGET at boot, and can be changed from Vial
+// #define ADC_RUNTIME_SAMPLING
+// enable USB start of frame aligned scanning - each frame capture is started at a fixed
+// phase of the 1ms USB frame, so the result is ready at the same time before every poll
+// #define ANALOG_SOF_SYNC
+// enable crosstalk compensation - the carry-over from the previous column is measured
+// at boot and subtracted from every multiplexer row
+// #define ADC_CROSSTALK_COMPENSATION
+// enable direct pin oversampling - ADCs which only read direct pins re-sample them
+// on the columns without a direct pin, each direct key gets the average of its samples
+// #define ADC_DIRECT_OVERSAMPLE
+// enable drift compensation - VREFINT and the temperature sensor are sampled between
+// frames, the change from rest is corrected for the temperature of the magnets
+// #define ADC_DRIFT_COMPENSATION
+// enable idle skipping - once every key has been at rest for a while, frames where
+// every sample stays inside its rest window are not processed
+// #define ANALOG_IDLE_SKIP
+// enable the scan thread - acquisition and actuation run in their own thread,
+// matrix_scan_custom only applies the row changes it publishes
+// #define ANALOG_SCAN_THREAD
 
 // number of multiplexer channels (must be 8 or 16 or 32)
 #define MATRIX_COLS 16
 // number of ADC channels (whichever has more * 2)
-/* any changes to this definition also requires modifying custom_analog.c */
 #define MATRIX_ROWS 8
 // number of direct pins (can span multiple ADCs) // MATRIX_DIRECT_RIGHT
-/* any changes to this definition also requires modifying custom_analog.c */
 #define MATRIX_DIRECT 4
 // max number of multiplexers per ADC
-/* any changes to this definition also requires modifying custom_analog.c */
 #define MAX_MUXES_PER_ADC 1
-// number of ADCs used on each side
-#define N_ADCS_SCANNED       3
-#define N_ADCS_SCANNED_RIGHT 3
 
 // Channel select pins
 #define MATRIX_COL_PINS { \
@@ -91,6 +117,32 @@ ADC2_IN1 = D */
 #endif
 */
 
+// Multiplexers read by each ADC
+/* X(arg, adc, rank, channel, row)
+adc     = ADC number (1-4)
+rank    = position in that ADC's conversion sequence, starting from 0
+channel = ADC channel of the multiplexer output (e.g. ADC1_IN3 is channel 3)
+row     = matrix row which the multiplexer is scanned into
+the conversion groups, sample buffers and row mapping in custom_analog.c are generated from this */
+#define ADC_LAYOUT_LEFT(X, arg) \
+    X(arg, 1, 0, 1, 0)          \
+    X(arg, 4, 0, 4, 1)
+#define ADC_LAYOUT_RIGHT(X, arg) \
+    X(arg, 1, 0, 4, 4)          \
+    X(arg, 3, 0, 1, 5)          \
+    X(arg, 4, 0, 3, 6)
+// Direct pins read by each ADC
+/* X(arg, adc, channel, row, col)
+an ADC with direct pins can't also read a multiplexer */
+#define ADC_DIRECT_LAYOUT_LEFT(X, arg) \
+    X(arg, 2, 3, 2, 0) /* W */  \
+    X(arg, 2, 4, 2, 1) /* A */  \
+    X(arg, 2, 2, 2, 2) /* S */  \
+    X(arg, 2, 1, 2, 3) /* D */
+#define ADC_DIRECT_LAYOUT_RIGHT(X, arg)
+// Channel converted when an ADC has nothing to convert, the sample is discarded
+#define ADC_PADDING_CHANNEL 1
+
 
 // bit array of whether key is valid
 // DIRECTION IS FLIPPED, 1ST BIT IS THE LAST COLUMN
@@ -105,8 +157,30 @@ ADC2_IN1 = D */
     0b0000000000000000  \
 }
 
+// Number of back-to-back samples averaged per column (1, 2, 4 or 8)
+/* the F303 has no hardware oversampling, the channel is repeated in the conversion sequence */
+#define ADC_SAMPLES_PER_COLUMN 1
+
+// Filter applied to the samples of every key by default, each key can select its own in analog_config
+/* ANALOG_FILTER_NONE, ANALOG_FILTER_SMA, ANALOG_FILTER_EMA, ANALOG_FILTER_MEDIAN3 or ANALOG_FILTER_ONE_EURO,
+samples are already denoised within the scan when oversampling, so the filter is skipped */
+#if ADC_SAMPLES_PER_COLUMN > 1
+# define ANALOG_FILTER_DEFAULT ANALOG_FILTER_NONE
+#else
+# define ANALOG_FILTER_DEFAULT ANALOG_FILTER_SMA
+#endif
 // Size of the simple moving average filter
 #define SMA_FILTER_SIZE 10
+// Weight of a new sample in the exponential moving average filter (1 / 2^shift)
+#define EMA_FILTER_SHIFT 2
+// Adaptive (one-euro style) filter - the weight of a new sample rises with the speed of the key
+/* weights are out of 256, speeds in counts per frame */
+// weight of a new sample while the key is at rest
+#define ONE_EURO_WEIGHT_MIN 32
+// increase of the weight per count per frame of speed
+#define ONE_EURO_BETA 4
+// weight of a new sample in the speed estimate
+#define ONE_EURO_WEIGHT_SPEED 64
 
 // Definitions for virtual axes
 #ifdef ANALOG_KEY_VIRTUAL_AXES
@@ -145,16 +219,113 @@ ADC2_IN1 = D */
 // Disable debounce
 #define DEBOUNCE 0
 
+// Timer triggered acquisition (TIM3)
+#ifdef ADC_TIMER_TRIGGER
+// number of columns converted per second
+# define ADC_TIMER_COLUMN_FREQUENCY 200000
+// timer ticks between switching the multiplexer and triggering the ADCs (1us)
+# define ADC_TIMER_SETTLE_TICKS 72
+// DMA streams which write the multiplexer select pins (TIM3_UP and TIM3_CH3)
+# define ADC_TIMER_MUX_DMA_STREAM0 STM32_DMA_STREAM_ID(1, 3)
+# define ADC_TIMER_MUX_DMA_STREAM1 STM32_DMA_STREAM_ID(1, 2)
+#endif
+
+// Idle skipping
+#ifdef ANALOG_IDLE_SKIP
+// number of frames with every key at rest before the rest windows are armed
+# define ANALOG_IDLE_FRAMES 200
+// margin around the samples seen at rest (12-bit counts)
+# define ANALOG_IDLE_MARGIN 16
+#endif
+// highest displacement which counts as at rest (0-200), for idle skipping and the ADC maintenance
+#define ANALOG_IDLE_DISPLACEMENT 4
+
+// USB start of frame aligned scanning
+#ifdef ANALOG_SOF_SYNC
+// delay from the start of frame to the start of the capture (0 starts it in the interrupt)
+# define ANALOG_SOF_OFFSET_US 0
+// free run if there has been no start of frame for this long
+# define ANALOG_SOF_TIMEOUT_MS 3
+#endif
+
+// Analog scan thread
+#ifdef ANALOG_SCAN_THREAD
+// priority of the scan thread (the main loop runs at NORMALPRIO)
+# define ANALOG_SCAN_THREAD_PRIORITY (NORMALPRIO + 8)
+// minimum time between two processed frames, leaves time for the main loop
+# define ANALOG_SCAN_THREAD_PERIOD_US 250
+// number of row changes which can be queued (must be a power of 2)
+# define ANALOG_EVENT_RING_SIZE 32
+// stack of the scan thread, it also tunes and calibrates the ADCs (DEBUG_MATRIX_SCAN_RATE prints what is left)
+# define ANALOG_SCAN_THREAD_STACK_SIZE 1024
+#endif
+
 // Set ADC resolution and sampling time
 #define ADC_RESOLUTION      ADC_CFGR_RES_12BITS
 #define ADC_SAMPLING_TIME   ADC_SMPR_SMP_2P5
 #define ADC_RESOLUTION_MAX  1 << 12
+// Time a frame may take before the acquisition is assumed stalled and restarted
+#define ADC_FRAME_TIMEOUT_MS 2
+#ifdef ADC_RUNTIME_SAMPLING
+// highest accepted peak to peak noise of a key at rest (12-bit counts)
+# define ADC_NOISE_TARGET 8
+// number of frames used to measure the noise
+# define ADC_NOISE_FRAMES 32
+#endif
+#ifdef ADC_CROSSTALK_COMPENSATION
+// number of frames averaged in each scan direction
+# define ADC_CROSSTALK_FRAMES 64
+// largest accepted coupling (Q12, 1024 = 0.25)
+# define ADC_CROSSTALK_MAX 1024
+// largest difference between the scan directions left after the coupling (counts)
+# define ADC_CROSSTALK_MAX_RESIDUAL 8
+#endif
+
+// Supply and temperature drift compensation
+#ifdef ADC_DRIFT_COMPENSATION
+// time between two samples of VREFINT and the temperature sensor
+# define ADC_DRIFT_INTERVAL_MS 1000
+// change of the magnet strength with temperature (ppm per degree, around -1200 for NdFeB)
+# define ADC_DRIFT_MAGNET_TEMPCO -1200
+// temperature change (0.1 degrees) which runs the adc self-calibration again
+# define ADC_DRIFT_RECALIBRATE_TEMP 50
+#endif
 // Max value of raw
 #define ANALOG_RAW_MAX_VALUE 2047
 // Max value of calibrated
 #define ANALOG_CAL_MAX_VALUE 1023
+// Gain of 1 for the change from rest (Q12)
+#define ANALOG_GAIN_UNITY (1 << 12)
 // Max value of rest - value at around 2mm into keypress
 #define ANALOG_MULTIPLIER_LUT_SIZE 512
+// Entries of the lookup tables generated per housekeeping task after a commit
+#define ANALOG_LUT_SLICE 64
+// Range of measured per-key travel which is accepted (percent of the shared curve)
+#define ANALOG_TRAVEL_MIN_PERCENT 50
+#define ANALOG_TRAVEL_MAX_PERCENT 200
+// Displacement below which a key which isn't pressed tracks its rest value (also below its release and actuation points)
+#define ANALOG_BASELINE_IDLE_DISPLACEMENT 4
+// Fractional bits of the tracked rest value
+#define ANALOG_BASELINE_SHIFT 8
+// The rest value moves 1 / 2^ANALOG_BASELINE_RATE of the way to each idle sample
+#define ANALOG_BASELINE_RATE 8
+// Frames whose lowest reading seeds the rest value of a key (a key never reads below rest)
+#define ANALOG_BASELINE_SEED_FRAMES 32
+// Largest rise of the rest value per millisecond (1 / 2^ANALOG_BASELINE_SHIFT counts), independent of the frame rate
+#define ANALOG_BASELINE_MAX_RISE 1
+
+// Guided calibration
+#ifdef ANALOG_CALIBRATION_MODE
+// time after which a calibration stops, the keys pressed so far are saved (ms)
+# define ANALOG_CALIBRATION_TIMEOUT_MS 60000
+// bins of the travel profile of each key, spread over the raw range
+# define ANALOG_CALIBRATION_PROFILE_BINS 16
+// a key has bottomed out once held within the tolerance (raw counts) of one value for the hold time (ms),
+// past a percent of the travel predicted by the shared curve - the saved travel is still bound by ANALOG_TRAVEL_*_PERCENT
+# define ANALOG_CALIBRATION_BOTTOM_PERCENT 80
+# define ANALOG_CALIBRATION_BOTTOM_TOLERANCE 4
+# define ANALOG_CALIBRATION_BOTTOM_HOLD_MS 30
+#endif
 
 
 
@@ -174,9 +345,9 @@ ADC2_IN1 = D */
 #define WEAR_LEVELING_LOGICAL_SIZE 4096
 #define WEAR_LEVELING_BACKING_SIZE 8192
 // Set size of EECONFIG for analog_config (per key)
-#define EECONFIG_USER_DATA_SIZE (5 * MATRIX_ROWS * MATRIX_COLS)
+#define EECONFIG_USER_DATA_SIZE (8 * MATRIX_ROWS * MATRIX_COLS)
 // Set size of EECONFIG for calibration (global)
-#define EECONFIG_KB_DATA_SIZE ((36 * 2) + (8 * 4) + 1)
+#define EECONFIG_KB_DATA_SIZE ((20 * 2) + (8 * 4) + 1)
 
 
 
@@ -187,7 +358,7 @@ ADC2_IN1 = D */
 // Slave to master:
 # define RPC_S2M_BUFFER_SIZE 32
 // Keyboard level data sync:
-# define SPLIT_TRANSACTION_IDS_KB KEYBOARD_SYNC_CONFIG
+# define SPLIT_TRANSACTION_IDS_KB KEYBOARD_SYNC_CONFIG, KEYBOARD_SYNC_CALIBRATION
 # define SPLIT_TRANSACTION_IDS_USER USER_SYNC_JOYSTICK
 #endif
 
@@ -1,40 +1,278 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
 
+#include <stdlib.h>
+#include <string.h>
+
 #include "print.h"
 
 #include "config.h"
 #include "custom_matrix.h"
 #include "custom_analog.h"
+#include "custom_scanning.h"
 #include "custom_analog_conversion_groups.h"
 
 // Declare the ADC manager instance
 __attribute__((section(".ram0")))
 static ADCManager adcManager;
 
+// Driver of each sample buffer
+#ifdef ADC_DUAL_MODE
+/* ADCD1 drives ADC1 (master) and ADC2 (slave)
+ADCD3 drives ADC3 (master) and ADC4 (slave) */
+static ADCDriver *const adc_drivers[N_ADC_BUFFERS] = { &ADCD1, &ADCD3 };
+#else
+static ADCDriver *const adc_drivers[N_ADC_BUFFERS] = { &ADCD1, &ADCD2, &ADCD3, &ADCD4 };
+#endif
+
 // External definitions
 extern SPLIT_MUTABLE_ROW pin_t row_pins[ROWS_PER_HAND];
 
+#ifdef ANALOG_SOF_SYNC
+// USB configuration with the start of frame callback replaced
+/* the configuration of QMK is const, so a copy is made and the original callback is chained */
+static USBConfig sof_config;
+static usbcallback_t sof_original_cb = NULL;
+static virtual_timer_t sof_timer;
+#endif
+
+// Error counters of each ADC
+static adc_health_t adc_health[4];
+
+// Wait for a frame before the acquisition is restarted
+/* with start of frame captures a timeout may also mean there is no start of frame (slave half, suspended) */
+#ifdef ANALOG_SOF_SYNC
+#    define ADC_WAIT_TIMEOUT_MS ANALOG_SOF_TIMEOUT_MS
+#else
+#    define ADC_WAIT_TIMEOUT_MS ADC_FRAME_TIMEOUT_MS
+#endif
+
+#ifdef ADC_CROSSTALK_COMPENSATION
+// Coupling from the previous column of each row on this hand (Q12)
+static int16_t adc_crosstalk[ROWS_PER_HAND];
+#endif
+
+#ifdef ADC_RUNTIME_SAMPLING
+// Sampling settings of each ADC
+static adc_sampling_t adc_sampling[4];
+// shift which scales the samples of each ADC to 12 bits
+static volatile uint8_t adc_resolution_shift[4] = { 0 };
+#endif
+
+#ifdef ADC_DRIFT_COMPENSATION
+// Factory calibration of VREFINT and the temperature sensor (12-bit, at VDDA = 3.3V)
+#define ADC_VREFINT_CAL (*(const uint16_t *)0x1FFFF7BAU)
+#define ADC_TS_CAL1     (*(const uint16_t *)0x1FFFF7B8U) // 30 degrees
+#define ADC_TS_CAL2     (*(const uint16_t *)0x1FFFF7C2U) // 110 degrees
+// samples of the drift group
+__attribute__((section(".ram0")))
+static adcsample_t adc_drift_samples[2 * ADC_ADCS_PER_BUFFER];
+static adc_drift_t adc_drift;
+static uint32_t adc_drift_timer = 0;
+#endif
+
+// Acquisition kernels of each hand
+/* bound once by initADCGroups, so the callbacks never check the handedness */
+typedef struct {
+    uint8_t hand;        // 0 left, 1 right
+    uint8_t row_offset;  // first (absolute) row of the hand
+    uint8_t completions; // callbacks per column
+    void (*store_column)(uint8_t current_col, uint8_t index); // copies the samples of a column into the frame
+} adc_hand_t;
+static void adcStoreColumnLeftI(uint8_t current_col, uint8_t index);
+static void adcStoreColumnRightI(uint8_t current_col, uint8_t index);
+static const adc_hand_t adc_hands[2] = {
+    { 0, 0,             N_ADC_COMPLETIONS,       adcStoreColumnLeftI },
+    { 1, ROWS_PER_HAND, N_ADC_COMPLETIONS_RIGHT, adcStoreColumnRightI }
+};
+static const adc_hand_t *adc_hand = &adc_hands[0];
+
+// Forward declarations
+static uint8_t getADCOfKey(uint8_t current_row, uint8_t current_col, uint8_t *rank);
+static adcsample_t getADCBufferSample(uint8_t current_row, uint8_t current_col, uint8_t index);
+#ifndef ADC_CONTINUOUS_SCAN
+static void adcStartColumnI(uint8_t current_col);
+#endif
+#ifdef ANALOG_SOF_SYNC
+static void adcInstallSofHook(void);
+#endif
+#ifdef ADC_DRIFT_COMPENSATION
+static void adcEnableInternalChannels(void);
+static bool adcMeasureDrift(void);
+#endif
+
+// store a sample in the frame being written
+static inline void adcStoreSampleI(uint8_t current_row, uint8_t current_col, adcsample_t sample){
+    adcManager.frameBuffer[adcManager.frameWrite].sample[current_row][current_col] = sample;
+#ifdef ANALOG_IDLE_SKIP
+    // flag samples outside of the rest window
+    if (sample < adcManager.idleLow[current_row][current_col] || sample > adcManager.idleHigh[current_row][current_col]){
+        adcManager.frameExcursion = true;
+    }
+#endif
+}
+
+// publish the frame which was just finished and start writing the other one
+static inline void adcPublishFrameI(void){
+    adcManager.frameBuffer[adcManager.frameWrite].sequence = ++adcManager.frameSequence;
+#ifdef ADC_CROSSTALK_COMPENSATION
+    adcManager.frameBuffer[adcManager.frameWrite].reversed = adcManager.reverse;
+#endif
+#ifdef ANALOG_IDLE_SKIP
+    // the frame is quiet if every sample stayed in its window, any excursion disarms the windows
+    adcManager.frameBuffer[adcManager.frameWrite].quiet = adcManager.idleArmed && !adcManager.frameExcursion;
+    if (adcManager.frameExcursion){
+        adcManager.idleArmed = false;
+    }
+    adcManager.frameExcursion = false;
+#endif
+    adcManager.frameReady = adcManager.frameWrite;
+    adcManager.frameWrite ^= 1;
+    chBSemSignalI(&adcManager.frameSem);
+}
+
+#ifdef ADC_DIRECT_OVERSAMPLE
+// Marks a slot without a direct pin
+#    define ADC_NO_DIRECT_COL 0xFF
+
+// next direct pin (by column) read by a buffer, round robin
+static uint8_t adcNextDirectColI(uint8_t hand, uint8_t buffer){
+    for (uint8_t k = 1; k <= MATRIX_COLS; k++){
+        uint8_t col = (adcManager.directCursor[buffer] + k) % MATRIX_COLS;
+        uint8_t adc = adc_direct_map[hand][col].adc;
+        if (adc != 0 && ADC_BUFFER_INDEX(adc) == buffer){
+            adcManager.directCursor[buffer] = col;
+            return col;
+        }
+    }
+    return ADC_NO_DIRECT_COL;
+}
+
+// add the direct pin samples of the column which just finished
+static void adcAccumulateDirectI(uint8_t hand){
+    for (uint8_t i = 0; i < N_ADC_BUFFERS; i++){
+        uint8_t col = adcManager.directSlotCol[i];
+        if (col == ADC_NO_DIRECT_COL){
+            continue;
+        }
+        adcManager.directSum[col] += getADCBufferSample(adc_direct_map[hand][col].row, col, 0);
+        adcManager.directSamples[col]++;
+    }
+}
+
+// replace the direct pin samples of the frame with the average of the frame
+static void adcStoreDirectAveragesI(uint8_t hand){
+    const uint8_t row_offset = hand * ROWS_PER_HAND;
+    for (uint8_t col = 0; col < MATRIX_COLS; col++){
+        if (adcManager.directSamples[col] == 0){
+            continue;
+        }
+        adcManager.frameBuffer[adcManager.frameWrite].sample[adc_direct_map[hand][col].row - row_offset][col] = 
+            adcManager.directSum[col] / adcManager.directSamples[col];
+        adcManager.directSum[col] = 0;
+        adcManager.directSamples[col] = 0;
+    }
+}
+#endif
+
+#ifndef ADC_CONTINUOUS_SCAN
+// column converted at a step of the frame
+/* frames are normally captured in graycode order, crosstalk calibration also captures them backwards */
+static inline uint8_t adcStepColumn(uint8_t step){
+#ifdef ADC_CROSSTALK_COMPENSATION
+    if (adcManager.reverse){
+        return graycode_col(MATRIX_COLS - 1 - step);
+    }
+#endif
+    return graycode_col(step);
+}
+
 // called whenever an adc conversion is completed
+/* once every adc has finished a column, the samples are copied into the frame,
+the multiplexer is switched to the next column and its conversion is started,
+so a whole frame is captured while the scan loop processes the previous one */
 void adcCompleteCallback(ADCDriver *adcp) {
     (void)adcp; // Unused parameter
     osalSysLockFromISR();
     adcManager.completedConversions++;
 
-    if (
-        ( is_keyboard_left() && adcManager.completedConversions >= N_ADCS_SCANNED) || 
-        (!is_keyboard_left() && adcManager.completedConversions >= N_ADCS_SCANNED_RIGHT)
-    )
-    {
-        chSemSignalI(&adcManager.sem);
+    if (adcManager.completedConversions >= adc_hand->completions){
+        uint8_t current_col = adcStepColumn(adcManager.currentStep);
+
+        // copy samples into the frame
+        adc_hand->store_column(current_col, 0);
+#ifdef ADC_DIRECT_OVERSAMPLE
+        adcAccumulateDirectI(adc_hand->hand);
+#endif
+
+        // start the next column, or publish the frame if it was the last column
+        adcManager.currentStep++;
+        if (adcManager.currentStep < MATRIX_COLS){
+            current_col = adcStepColumn(adcManager.currentStep);
+            select_multiplexer_channel(current_col);
+            adcStartColumnI(current_col);
+        }
+        else {
+            adcManager.capturing = false;
+#ifdef ADC_DIRECT_OVERSAMPLE
+            adcStoreDirectAveragesI(adc_hand->hand);
+#endif
+            adcPublishFrameI();
+        }
     }
     
     osalSysUnlockFromISR();
 }
+#endif
 
 // initialise adc pins and start the adcs
 void initADCGroups(void) {
+    // bind the kernels of this hand
+    adc_hand = &adc_hands[is_keyboard_left() ? 0 : 1];
+
     adcManager.completedConversions = 0;
-    chSemObjectInit(&adcManager.sem, 0);
+    adcManager.frameWrite = 0;
+    adcManager.frameReady = 1;
+    adcManager.frameSequence = 0;
+    chBSemObjectInit(&adcManager.frameSem, true);
+#ifdef ANALOG_SOF_SYNC
+    adcManager.sofSynced = false;
+    chVTObjectInit(&sof_timer);
+    adcInstallSofHook();
+#endif
+#ifdef ADC_CROSSTALK_COMPENSATION
+    adcManager.reverse = false;
+    adcManager.reverseNext = false;
+    memset(adc_crosstalk, 0, sizeof(adc_crosstalk));
+#endif
+#ifdef ANALOG_IDLE_SKIP
+    adcManager.idleArmed = false;
+    adcManager.frameExcursion = false;
+#endif
+#ifdef ADC_DIRECT_OVERSAMPLE
+    // find the buffers which read direct pins on this hand
+    const uint8_t hand = adc_hand->hand;
+    adcManager.directBuffers = 0;
+    for (uint8_t col = 0; col < MATRIX_COLS; col++){
+        if (adc_direct_map[hand][col].adc != 0){
+            adcManager.directBuffers |= (1 << ADC_BUFFER_INDEX(adc_direct_map[hand][col].adc));
+        }
+        adcManager.directSum[col] = 0;
+        adcManager.directSamples[col] = 0;
+    }
+    for (uint8_t i = 0; i < N_ADC_BUFFERS; i++){
+        adcManager.directSlotCol[i] = ADC_NO_DIRECT_COL;
+        adcManager.directCursor[i] = 0;
+    }
+#endif
+
+#ifdef ADC_RUNTIME_SAMPLING
+    for (uint8_t i = 0; i < 4; i++){
+        adc_sampling[i].sampling_time = ADC_SAMPLING_TIME;
+        adc_sampling[i].resolution = (ADC_RESOLUTION == ADC_CFGR_RES_10BITS) ? 10 : 12;
+        adc_sampling[i].noise = 0;
+        adc_resolution_shift[i] = 12 - adc_sampling[i].resolution;
+    }
+#endif
 
     // Set input mode of pins to analog
     for (uint8_t i = 0; i < ROWS_PER_HAND; i++) {
@@ -60,91 +298,1016 @@ void initADCGroups(void) {
     }
 #endif
     
-    /* Start ADCs
-    Left uses 1,2,4
-    Right uses 1,3,4 */
-    adcStart(&ADCD1, NULL);
-    adcStart(&ADCD2, NULL);
-    adcStart(&ADCD3, NULL);
-    adcStart(&ADCD4, NULL);
+    // Start ADCs (or ADC pairs)
+    for (uint8_t i = 0; i < N_ADC_BUFFERS; i++){
+        adcStart(adc_drivers[i], NULL);
+    }
+
+#ifdef ADC_DRIFT_COMPENSATION
+    // adcStart has run the self-calibration, the temperature at boot is the reference of the gain
+    adcEnableInternalChannels();
+    adc_drift.temperature = 0;
+    adcMeasureDrift();
+    adc_drift.reference = adc_drift.temperature;
+    adc_drift.calibrated = adc_drift.temperature;
+    adc_drift.gain = ANALOG_GAIN_UNITY;
+    adc_drift_timer = timer_read32();
+#endif
 
     return;
 }
 
-// start converting (non-continuous)
-msg_t adcStartAllConversions(uint8_t current_col){
-    osalSysLock();
+#ifndef ADC_CONTINUOUS_SCAN
+// start converting one column (non-continuous)
+static void adcStartColumnI(uint8_t current_col){
     adcManager.completedConversions = 0;
 
+    const uint8_t hand = adc_hand->hand;
+    const adc_direct_map_t *direct = &adc_direct_map[hand][current_col];
+
     // Start conversion groups
-    if (is_keyboard_left()){
-        // Scan multiplexers
-        adcStartConversionI(&ADCD1, &adcConversionGroup1, adcManager.sampleBuffer0, 1);
-        adcStartConversionI(&ADCD4, &adcConversionGroup4, adcManager.sampleBuffer1, 1);
-        // Scan direct pins - only scan one channel, regardless of how many channels are scanned on other ADCs
-        switch (current_col){
-            case 0: // W
-                adcStartConversionI(&ADCD2, &adcConversionGroup3, adcManager.sampleBuffer2, 1);
-                break;
-            case 1: // A
-                adcStartConversionI(&ADCD2, &adcConversionGroup4, adcManager.sampleBuffer2, 1);
-                break;
-            case 2: // S
-                adcStartConversionI(&ADCD2, &adcConversionGroup2, adcManager.sampleBuffer2, 1);
-                break;
-            case 3: // D
-                adcStartConversionI(&ADCD2, &adcConversionGroup1, adcManager.sampleBuffer2, 1);
-                break;
-            default: // increment completedConversions without doing an ADC conversion
-                adcManager.sampleBuffer2[0] = ANALOG_RAW_MAX_VALUE;
-                adcManager.completedConversions++;
-                break;
+    for (uint8_t i = 0; i < N_ADC_BUFFERS; i++){
+        // skip unused ADCs
+        if (adc_buffer_length[hand][i] == 0){
+            continue;
+        }
+        // convert the direct pin of this column, otherwise the usual sequence
+        if (direct->adc != 0 && ADC_BUFFER_INDEX(direct->adc) == i){
+#ifdef ADC_DIRECT_OVERSAMPLE
+            adcManager.directSlotCol[i] = current_col;
+#endif
+            adcStartConversionI(adc_drivers[i], &adcDirectGroups[hand][current_col], adcManager.sampleBuffer[i], 1);
+        }
+#ifdef ADC_DIRECT_OVERSAMPLE
+        // re-sample one of the direct pins instead of converting padding
+        else if (adcManager.directBuffers & (1 << i)){
+            uint8_t direct_col = adcNextDirectColI(hand, i);
+            adcManager.directSlotCol[i] = direct_col;
+            adcStartConversionI(adc_drivers[i], &adcDirectGroups[hand][direct_col], adcManager.sampleBuffer[i], 1);
+        }
+#endif
+        else {
+#ifdef ADC_DIRECT_OVERSAMPLE
+            adcManager.directSlotCol[i] = ADC_NO_DIRECT_COL;
+#endif
+            adcStartConversionI(adc_drivers[i], &adcGroups[hand][i], adcManager.sampleBuffer[i], 1);
         }
     }
-    else {
-        adcStartConversionI(&ADCD1, &adcConversionGroup4, adcManager.sampleBuffer3, 1);
-        adcStartConversionI(&ADCD3, &adcConversionGroup1, adcManager.sampleBuffer4, 1);
-        adcStartConversionI(&ADCD4, &adcConversionGroup3, adcManager.sampleBuffer5, 1);
+}
+
+// start capturing a frame, unless one is already being captured
+static void adcStartFrameCaptureI(void){
+    if (!adcManager.capturing){
+        adcManager.capturing = true;
+        adcManager.currentStep = 0;
+#ifdef ADC_CROSSTALK_COMPENSATION
+        adcManager.reverse = adcManager.reverseNext;
+#endif
+
+        // switch multiplexer to first column
+        select_multiplexer_channel(adcStepColumn(0));
+        adcStartColumnI(adcStepColumn(0));
     }
-    
+}
+
+msg_t adcStartFrameCapture(void){
+    osalSysLock();
+    adcStartFrameCaptureI();
     osalSysUnlock();
     return MSG_OK;
 }
+#endif
+
+#ifdef ANALOG_SOF_SYNC
+// start the frame capture at the configured phase of the USB frame
+static void adcSofTimerCallback(virtual_timer_t *vtp, void *p){
+    (void)vtp;
+    (void)p;
+    osalSysLockFromISR();
+    adcStartFrameCaptureI();
+    osalSysUnlockFromISR();
+}
 
-// wait until the semaphore is triggered
-msg_t adcWaitForConversions(void){
-    
-    chSemWait(&adcManager.sem);
+// called on every USB start of frame (1ms)
+static void adcSofCallback(USBDriver *usbp){
+    if (sof_original_cb != NULL){
+        sof_original_cb(usbp);
+    }
 
+    osalSysLockFromISR();
+    adcManager.sofSynced = true;
+#    if ANALOG_SOF_OFFSET_US > 0
+    if (!chVTIsArmedI(&sof_timer)){
+        chVTSetI(&sof_timer, TIME_US2I(ANALOG_SOF_OFFSET_US), adcSofTimerCallback, NULL);
+    }
+#    else
+    adcStartFrameCaptureI();
+#    endif
+    osalSysUnlockFromISR();
+}
+
+// chain the start of frame callback into the configuration of the USB driver
+/* QMK restarts the USB driver with its own configuration on wakeup, so this is repeated when SOFs stop */
+static void adcInstallSofHook(void){
+    if (!is_keyboard_master()){
+        return;
+    }
+    osalSysLock();
+    if (USBD1.config != NULL && USBD1.config != &sof_config){
+        sof_config = *USBD1.config;
+        sof_original_cb = sof_config.sof_cb;
+        sof_config.sof_cb = adcSofCallback;
+        USBD1.config = &sof_config;
+    }
+    osalSysUnlock();
+}
+#endif
+
+_Static_assert(
+    ADC_SAMPLES_PER_COLUMN == 1 || ADC_SAMPLES_PER_COLUMN == 2 || 
+    ADC_SAMPLES_PER_COLUMN == 4 || ADC_SAMPLES_PER_COLUMN == 8, 
+    "ADC_SAMPLES_PER_COLUMN must be 1, 2, 4 or 8"
+);
+
+// average the back-to-back samples of one column
+static inline adcsample_t adcAverageSamples(const adcsample_t *samples, uint8_t stride) {
+#if ADC_SAMPLES_PER_COLUMN > 1
+    uint32_t sum = 0;
+    for (uint8_t i = 0; i < ADC_SAMPLES_PER_COLUMN; i++){
+        sum += samples[i * stride];
+    }
+    return (adcsample_t) (sum / ADC_SAMPLES_PER_COLUMN);
+#else
+    (void)stride; // Unused parameter
+    return samples[0];
+#endif
+}
+
+// find the adc (1-4, 0 if none) which converts a key, and its rank in the sequence
+static uint8_t getADCOfKey(uint8_t current_row, uint8_t current_col, uint8_t *rank) {
+    const uint8_t hand = current_row / ROWS_PER_HAND;
+    uint8_t adc = adc_row_map[current_row].adc;
+    *rank = adc_row_map[current_row].rank;
+
+    // rows without a multiplexer may have a direct pin on this column
+    if (adc == 0 && adc_direct_map[hand][current_col].row == current_row){
+        adc = adc_direct_map[hand][current_col].adc;
+        *rank = 0;
+    }
+    return adc;
+}
+
+// read the sample of an adc at a rank of its sequence
+/* index selects the column within the buffer - the half of a circular buffer, or the step of a timer frame */
+static inline adcsample_t adcReadBufferI(uint8_t hand, uint8_t adc, uint8_t rank, uint8_t index) {
+    const uint8_t buffer = ADC_BUFFER_INDEX(adc);
+    const uint16_t offset = 
+        (index * adc_buffer_length[hand][buffer] + rank) * ADC_SAMPLES_PER_COLUMN * ADC_ADCS_PER_BUFFER + 
+        ADC_BUFFER_SIDE(adc);
+#ifdef ADC_RUNTIME_SAMPLING
+    return adcAverageSamples(&adcManager.sampleBuffer[buffer][offset], ADC_ADCS_PER_BUFFER) << adc_resolution_shift[adc - 1];
+#else
+    return adcAverageSamples(&adcManager.sampleBuffer[buffer][offset], ADC_ADCS_PER_BUFFER);
+#endif
+}
+
+// retrieve an adc sample from a given position in the sample buffers
+static adcsample_t getADCBufferSample(uint8_t current_row, uint8_t current_col, uint8_t index) {
+    const uint8_t hand = current_row / ROWS_PER_HAND;
+    uint8_t rank = 0;
+    const uint8_t adc = getADCOfKey(current_row, current_col, &rank);
+
+    // DKS rows and columns without a key
+    if (adc == 0){
+        return ANALOG_RAW_MAX_VALUE;
+    }
+    return adcReadBufferI(hand, adc, rank, index);
+}
+
+// position of the direct pin samples of a column within the buffer of their adc
+#ifdef ADC_CIRCULAR_DMA
+/* direct pin ADCs only convert on the columns of their pins, so they keep their own half */
+#    define ADC_DIRECT_INDEX(__adc, __index) (adcManager.directSlot[ADC_BUFFER_INDEX(__adc)])
+#else
+#    define ADC_DIRECT_INDEX(__adc, __index) (__index)
+#endif
+
+// copy the samples of one column into the frame, one kernel per hand is generated from its layout tables
+/* the adc and rank of every multiplexer row are constants, rows without a multiplexer read
+ANALOG_RAW_MAX_VALUE unless the column has a direct pin on them */
+#define ADC_MUX_ROW_BIT(__arg, __adcn, __rank, __channel, __row) | (1U << ((__row) % ROWS_PER_HAND))
+#define ADC_STORE_MUX_ROW(__hand, __adcn, __rank, __channel, __row) \
+    adcStoreSampleI((__row) % ROWS_PER_HAND, current_col, adcReadBufferI(__hand, __adcn, __rank, index));
+#define ADC_STORE_COLUMN_KERNEL(__name, __layout, __hand)                                       \
+static void __name(uint8_t current_col, uint8_t index){                                        \
+    const uint8_t mux_rows = 0U __layout(ADC_MUX_ROW_BIT, 0);                                   \
+    const adc_direct_map_t *direct = &adc_direct_map[__hand][current_col];                      \
+    const uint8_t direct_row = (direct->adc != 0) ? (direct->row % ROWS_PER_HAND) : ROWS_PER_HAND; \
+    for (uint8_t current_row = 0; current_row < ROWS_PER_HAND; current_row++){                   \
+        if (!(mux_rows & (1U << current_row))){                                                 \
+            adcStoreSampleI(current_row, current_col, (current_row == direct_row) ?             \
+                adcReadBufferI(__hand, direct->adc, 0, ADC_DIRECT_INDEX(direct->adc, index)) :  \
+                ANALOG_RAW_MAX_VALUE);                                                          \
+        }                                                                                       \
+    }                                                                                           \
+    __layout(ADC_STORE_MUX_ROW, __hand)                                                         \
+}
+ADC_STORE_COLUMN_KERNEL(adcStoreColumnLeftI,  ADC_LAYOUT_LEFT,  0)
+ADC_STORE_COLUMN_KERNEL(adcStoreColumnRightI, ADC_LAYOUT_RIGHT, 1)
+
+
+#ifdef ADC_CIRCULAR_DMA
+// start the next conversion of an adc which is already streaming into its circular buffer
+static inline void adcRetriggerI(ADCDriver *adcp){
+    adcp->adcm->CR |= ADC_CR_ADSTART;
+}
+
+// retrigger every adc used by this half, switching direct pin ADCs to the pin of the column
+/* direct pin ADCs are only retriggered on the columns of their pins, they keep their own half of the buffer */
+static void adcRetriggerAllI(uint8_t current_col){
+    const uint8_t hand = adc_hand->hand;
+    const adc_direct_map_t *direct = &adc_direct_map[hand][current_col];
+
+    for (uint8_t i = 0; i < N_ADC_BUFFERS; i++){
+        if (adc_buffer_length[hand][i] == 0){
+            continue;
+        }
+        if (adc_direct_mask[hand] & (1 << i)){
+            if (direct->adc != i + 1){
+                continue;
+            }
+            adc_drivers[i]->adcm->SQR1 = ADC_SQR1_NUM_CH(ADC_SAMPLES_PER_COLUMN) | ADC_SQR1_REPEAT(direct->channel);
+            adc_drivers[i]->adcm->SQR2 = ADC_SQR2_REPEAT(direct->channel);
+        }
+        adcRetriggerI(adc_drivers[i]);
+    }
+}
+
+// callbacks expected for a column, direct pin ADCs without a pin on it aren't converting
+static inline uint8_t adcColumnCompletionsI(uint8_t current_col){
+    const uint8_t hand = adc_hand->hand;
+    if (adcManager.directStarting){
+        return adc_hand->completions;
+    }
+    return adc_hand->completions - __builtin_popcount(adc_direct_mask[hand]) + (adc_direct_map[hand][current_col].adc != 0);
+}
+
+// move the direct pin ADCs which converted a column on to the other half of their buffer
+static inline void adcAdvanceDirectSlotsI(uint8_t current_col){
+    const uint8_t hand = adc_hand->hand;
+    if (adcManager.directStarting){
+        // every adc converted the first column, the ones without a pin on it converted padding
+        for (uint8_t i = 0; i < N_ADC_BUFFERS; i++){
+            adcManager.directSlot[i] ^= 1;
+        }
+        adcManager.directStarting = false;
+    }
+    else if (adc_direct_map[hand][current_col].adc != 0){
+        adcManager.directSlot[ADC_BUFFER_INDEX(adc_direct_map[hand][current_col].adc)] ^= 1;
+    }
+}
+
+// called on every half/full transfer of the circular buffers
+/* once every adc has finished a column, the samples are copied into the frame,
+the multiplexer is switched to the next column and the next conversion is started */
+void adcCircularCallback(ADCDriver *adcp) {
+    (void)adcp; // Unused parameter
+    osalSysLockFromISR();
+    adcManager.completedConversions++;
+
+    uint8_t current_col = graycode_col(adcManager.currentStep);
+    if (adcManager.completedConversions >= adcColumnCompletionsI(current_col)){
+        // copy samples into the frame
+        adc_hand->store_column(current_col, adcManager.bufferSlot);
+        adcAdvanceDirectSlotsI(current_col);
+
+        // move to the next column, publish the frame if it was the last column
+        adcManager.currentStep = (adcManager.currentStep + 1) % MATRIX_COLS;
+        if (adcManager.currentStep == 0){
+            adcPublishFrameI();
+        }
+
+        // switch multiplexer and start the next conversion into the other half of the buffers
+        current_col = graycode_col(adcManager.currentStep);
+        select_multiplexer_channel(current_col);
+        adcManager.bufferSlot ^= 1;
+        adcManager.completedConversions = 0;
+        adcRetriggerAllI(current_col);
+    }
+
+    osalSysUnlockFromISR();
+}
+
+// start continuous conversions (circular)
+msg_t adcStartContinuousScan(void){
+    osalSysLock();
+    adcManager.completedConversions = 0;
+    adcManager.bufferSlot = 0;
+    adcManager.currentStep = 0;
+    memset(adcManager.directSlot, 0, sizeof(adcManager.directSlot));
+    adcManager.directStarting = true;
+
+    // switch multiplexer to first column
+    select_multiplexer_channel(0);
+
+    // Start circular conversion groups, each conversion after this one is retriggered by the callback
+    const uint8_t hand = adc_hand->hand;
+    for (uint8_t i = 0; i < N_ADC_BUFFERS; i++){
+        if (adc_buffer_length[hand][i] == 0){
+            continue;
+        }
+        adcStartConversionI(adc_drivers[i], &adcGroups[hand][i], adcManager.sampleBuffer[i], ADC_BUFFER_DEPTH);
+    }
+
+    osalSysUnlock();
     return MSG_OK;
 }
 
-// retrieve an adc sample
-adcsample_t getADCSample(uint8_t current_row) {
-    switch (current_row) {
-
-        // Left
-        case 0:
-            return adcManager.sampleBuffer0[0];
-        case 1:
-            return adcManager.sampleBuffer1[0];
-        case 2:
-            return adcManager.sampleBuffer2[0];
-        case 3:
-            return ANALOG_RAW_MAX_VALUE; // This row is used for DKS
-
-        // Right
-        case 4:
-            return adcManager.sampleBuffer3[0];
-        case 5:
-            return adcManager.sampleBuffer4[0];
-        case 6:
-            return adcManager.sampleBuffer5[0];
-        case 7:
-            return ANALOG_RAW_MAX_VALUE; // This row is used for DKS
-
-        // Invalid index
+#endif
+
+#ifdef ADC_TIMER_TRIGGER
+// called on every half/full transfer of the frame buffers
+/* all ADCs are triggered by the same timer, so once all of them have reported
+the matching half of every buffer is stable for another half frame */
+void adcTimerCallback(ADCDriver *adcp) {
+    osalSysLockFromISR();
+    adcManager.completedConversions++;
+
+    if (adcManager.completedConversions >= adc_hand->completions){
+        uint8_t first_step = adcIsBufferComplete(adcp) ? (MATRIX_COLS / 2) : 0;
+
+        // copy this half of the samples into the frame
+        for (uint8_t step = first_step; step < first_step + (MATRIX_COLS / 2); step++){
+            adc_hand->store_column(graycode_col(step), step);
+        }
+
+        // publish the frame once the second half is copied
+        if (first_step != 0){
+            adcPublishFrameI();
+        }
+
+        adcManager.completedConversions = 0;
+    }
+
+    osalSysUnlockFromISR();
+}
+
+// start the DMA streams which write the multiplexer select pins
+/* the streams are allocated once, restarting the acquisition rewinds them to the first column */
+static void adcStartMultiplexerDMA(void){
+    static const uint32_t stream_ids[MUX_PORTS] = {
+        ADC_TIMER_MUX_DMA_STREAM0, 
+        ADC_TIMER_MUX_DMA_STREAM1
+    };
+    static const stm32_dma_stream_t *streams[MUX_PORTS] = { NULL };
+    for (uint8_t p = 0; p < MUX_PORTS; p++){
+        if (mux_port[p] == NULL){
+            continue;
+        }
+        if (streams[p] == NULL){
+            streams[p] = dmaStreamAlloc(stream_ids[p], 3, NULL, NULL);
+        }
+        else {
+            dmaStreamDisable(streams[p]);
+        }
+        const stm32_dma_stream_t *stream = streams[p];
+        dmaStreamSetPeripheral(stream, &mux_port[p]->BSRR);
+        dmaStreamSetMemory0(stream, mux_dma_bsrr[p]);
+        dmaStreamSetTransactionSize(stream, MATRIX_COLS);
+        dmaStreamSetMode(stream, 
+            STM32_DMA_CR_DIR_M2P | STM32_DMA_CR_MINC | STM32_DMA_CR_CIRC | 
+            STM32_DMA_CR_PSIZE_WORD | STM32_DMA_CR_MSIZE_WORD | STM32_DMA_CR_PL(3)
+        );
+        dmaStreamEnable(stream);
+    }
+}
+
+// start the timer which paces the acquisition
+/* every period: update event -> DMA writes port 0, CC3 (1 tick later) -> DMA writes port 1,
+OC4REF rises after the settle time -> TRGO starts the ADCs */
+static void adcStartTriggerTimer(void){
+    rccEnableTIM3(true);
+    rccResetTIM3();
+
+    TIM3->PSC   = 0;
+    TIM3->ARR   = (STM32_TIMCLK1 / ADC_TIMER_COLUMN_FREQUENCY) - 1;
+    TIM3->CCR3  = 1;
+    TIM3->CCR4  = ADC_TIMER_SETTLE_TICKS;
+    // OC4 in PWM mode 2, so OC4REF rises when the counter reaches CCR4
+    TIM3->CCMR2 = TIM_CCMR2_OC4M_2 | TIM_CCMR2_OC4M_1 | TIM_CCMR2_OC4M_0;
+    // TRGO = OC4REF
+    TIM3->CR2   = TIM_CR2_MMS_2 | TIM_CR2_MMS_1 | TIM_CR2_MMS_0;
+    // DMA requests on update (port 0) and CC3 (port 1)
+    TIM3->DIER  = TIM_DIER_UDE | TIM_DIER_CC3DE;
+
+    // the update event writes the first column to port 0, port 1 follows on CC3 of the first period
+    TIM3->EGR   = TIM_EGR_UG;
+    TIM3->CR1   = TIM_CR1_CEN;
+}
+
+// start continuous conversions (timer triggered)
+msg_t adcStartContinuousScan(void){
+    osalSysLock();
+    adcManager.completedConversions = 0;
+
+    // Arm the ADCs, each conversion waits for a trigger from the timer
+    /* direct pin ADCs convert half a frame per pass of their sequence, so their buffer is two passes deep */
+    const uint8_t hand = adc_hand->hand;
+    for (uint8_t i = 0; i < N_ADC_BUFFERS; i++){
+        if (adc_buffer_length[hand][i] == 0){
+            continue;
+        }
+        bool direct = adc_direct_mask[hand] & (1 << i);
+        adcStartConversionI(adc_drivers[i], &adcGroups[hand][i], adcManager.sampleBuffer[i], direct ? 2 : ADC_BUFFER_DEPTH);
+    }
+
+    osalSysUnlock();
+
+    // Start stepping the multiplexer and triggering conversions
+    adcStartMultiplexerDMA();
+    adcStartTriggerTimer();
+    return MSG_OK;
+}
+#endif
+
+#ifdef ADC_RUNTIME_SAMPLING
+// write the sampling settings of an adc into one group
+/* in dual mode the slave only has its own sampling time, the resolution of a pair is fixed */
+static void adcSetGroupSampling(ADCConversionGroup *grp, uint8_t adc, const uint32_t smpr[2], uint32_t res){
+#ifdef ADC_DUAL_MODE
+    if (ADC_BUFFER_SIDE(adc) == 1){
+        grp->ssmpr[0] = smpr[0];
+        grp->ssmpr[1] = smpr[1];
+        return;
+    }
+#endif
+    grp->smpr[0] = smpr[0];
+    grp->smpr[1] = smpr[1];
+    grp->cfgr = (grp->cfgr & ~ADC_CFGR_RES_MASK) | res;
+}
+
+// write the sampling settings of an adc into every group which uses it
+/* the groups are read on every start, so the settings apply from the next column */
+static void adcApplySamplingI(uint8_t adc){
+    const uint8_t buffer = ADC_BUFFER_INDEX(adc);
+    const uint32_t smpr[2] = ADC_SMPR_ALL(adc_sampling[adc - 1].sampling_time);
+    const uint32_t res = (adc_sampling[adc - 1].resolution == 10) ? ADC_CFGR_RES_10BITS : ADC_CFGR_RES_12BITS;
+
+    for (uint8_t hand = 0; hand < 2; hand++){
+        adcSetGroupSampling(&adcGroups[hand][buffer], adc, smpr, res);
+        for (uint8_t col = 0; col < MATRIX_COLS; col++){
+            const uint8_t direct_adc = adc_direct_map[hand][col].adc;
+            if (direct_adc != 0 && ADC_BUFFER_INDEX(direct_adc) == buffer){
+                adcSetGroupSampling(&adcDirectGroups[hand][col], adc, smpr, res);
+            }
+        }
+    }
+    adc_resolution_shift[adc - 1] = 12 - adc_sampling[adc - 1].resolution;
+}
+
+// change the sampling time and resolution of an adc (1-4)
+bool adcSetSampling(uint8_t adc, uint8_t sampling_time, uint8_t resolution){
+    if (adc < 1 || adc > 4 || sampling_time > ADC_SMPR_SMP_601P5){
+        return false;
+    }
+#ifdef ADC_DUAL_MODE
+    if (resolution != adc_sampling[adc - 1].resolution){
+        return false;
+    }
+#else
+    if (resolution != 10 && resolution != 12){
+        return false;
+    }
+#endif
+    osalSysLock();
+    adc_sampling[adc - 1].sampling_time = sampling_time;
+    adc_sampling[adc - 1].resolution = resolution;
+    adcApplySamplingI(adc);
+    osalSysUnlock();
+    return true;
+}
+
+// read the sampling settings of an adc (1-4)
+bool adcGetSampling(uint8_t adc, adc_sampling_t *sampling){
+    if (adc < 1 || adc > 4){
+        return false;
+    }
+    *sampling = adc_sampling[adc - 1];
+    return true;
+}
+
+// tuning in progress, started by adcTuneSamplingStart and advanced one frame at a time by adcTuneSamplingStep
+static struct {
+    const matrix_row_t *mask;
+    uint8_t sampling_time;
+    uint8_t tuned;  // one bit per adc
+    uint8_t frames; // frames seen at the current sampling time
+    adcsample_t low[ROWS_PER_HAND][MATRIX_COLS];
+    adcsample_t high[ROWS_PER_HAND][MATRIX_COLS];
+} adc_tune;
+
+// start each adc at its fastest sampling time
+static void adcTuneSetSampling(void){
+    for (uint8_t adc = 1; adc <= 4; adc++){
+        if (!(adc_tune.tuned & (1 << (adc - 1)))){
+            adcSetSampling(adc, adc_tune.sampling_time, adc_sampling[adc - 1].resolution);
+        }
+    }
+    adc_tune.frames = 0;
+}
+
+// keep the peak to peak noise of the keys read by each adc
+static void adcTuneSampleNoise(uint16_t noise[4]){
+    const uint8_t row_offset = adc_hand->row_offset;
+
+    memset(noise, 0, 4 * sizeof(uint16_t));
+    for (uint8_t row = 0; row < ROWS_PER_HAND; row++){
+        for (uint8_t col = 0; col < MATRIX_COLS; col++){
+            uint8_t rank;
+            uint8_t adc = getADCOfKey(row + row_offset, col, &rank);
+            if (adc == 0 || !(adc_tune.mask[row + row_offset] & (1 << col))){
+                continue;
+            }
+            noise[adc - 1] = MAX(noise[adc - 1], adc_tune.high[row][col] - adc_tune.low[row][col]);
+        }
+    }
+}
+
+// pick the fastest sampling time of each adc which meets ADC_NOISE_TARGET
+/* keys are assumed to be at rest, a pressed key only makes an adc slower than it needs to be */
+void adcTuneSamplingStart(const matrix_row_t *mask){
+    adc_tune.mask = mask;
+    adc_tune.sampling_time = ADC_SMPR_SMP_1P5;
+    adc_tune.tuned = 0;
+    adcTuneSetSampling();
+}
+
+// measure the noise of one frame, returns true once every adc is tuned
+/* the first frame at a sampling time may have been converted with the old settings, so it is skipped */
+bool adcTuneSamplingStep(const adc_frame_t *frame){
+    adc_tune.frames++;
+    if (adc_tune.frames == 1){
+        return false;
+    }
+    if (adc_tune.frames == 2){
+        memcpy(adc_tune.low,  frame->sample, sizeof(adc_tune.low));
+        memcpy(adc_tune.high, frame->sample, sizeof(adc_tune.high));
+    }
+    else {
+        for (uint8_t row = 0; row < ROWS_PER_HAND; row++){
+            for (uint8_t col = 0; col < MATRIX_COLS; col++){
+                adc_tune.low[row][col]  = MIN(adc_tune.low[row][col],  frame->sample[row][col]);
+                adc_tune.high[row][col] = MAX(adc_tune.high[row][col], frame->sample[row][col]);
+            }
+        }
+    }
+    if (adc_tune.frames < ADC_NOISE_FRAMES + 1){
+        return false;
+    }
+
+    uint16_t noise[4];
+    adcTuneSampleNoise(noise);
+    for (uint8_t adc = 1; adc <= 4; adc++){
+        if (!(adc_tune.tuned & (1 << (adc - 1)))){
+            adc_sampling[adc - 1].noise = noise[adc - 1];
+            if (noise[adc - 1] <= ADC_NOISE_TARGET){
+                adc_tune.tuned |= (1 << (adc - 1));
+            }
+        }
+    }
+    if (adc_tune.tuned == 0x0F || adc_tune.sampling_time == ADC_SMPR_SMP_601P5){
+        return true;
+    }
+
+    // the adcs which are still too noisy try the next sampling time
+    adc_tune.sampling_time++;
+    adcTuneSetSampling();
+    return false;
+}
+
+// tune every adc, waiting on the frames (at startup)
+void adcTuneSampling(const matrix_row_t *mask){
+    static adc_frame_t frame;
+
+    adcTuneSamplingStart(mask);
+    do {
+        adcWaitForFrame(&frame);
+    } while (!adcTuneSamplingStep(&frame));
+}
+#endif
+
+#ifdef ANALOG_IDLE_SKIP
+// arm the rest window of every key, frames without an excursion are published as quiet
+/* the frame being captured may have started before the windows were set, so it is never quiet */
+void adcArmIdleWindows(const adcsample_t low[ROWS_PER_HAND][MATRIX_COLS], const adcsample_t high[ROWS_PER_HAND][MATRIX_COLS]){
+    osalSysLock();
+    memcpy(adcManager.idleLow,  low,  sizeof(adcManager.idleLow));
+    memcpy(adcManager.idleHigh, high, sizeof(adcManager.idleHigh));
+    adcManager.idleArmed = true;
+    adcManager.frameExcursion = true;
+    osalSysUnlock();
+}
+
+// whether the rest windows are armed (cleared by the first excursion)
+bool adcIdleArmed(void){
+    return adcManager.idleArmed;
+}
+#endif
+
+// adc (1-4) of a driver, the master in dual mode
+static uint8_t adcDriverADC(ADCDriver *adcp){
+    for (uint8_t i = 0; i < N_ADC_BUFFERS; i++){
+        if (adc_drivers[i] == adcp){
+            return i * ADC_ADCS_PER_BUFFER + 1;
+        }
+    }
+    return 1;
+}
+
+// count adc errors
+/* the driver has already stopped the conversion, so the frame is recovered by adcWaitForRawFrame,
+nothing is printed as this runs in the interrupt */
+void adcErrorCallback(ADCDriver *adcp, adcerror_t err) {
+    osalSysLockFromISR();
+    adc_health_t *health = &adc_health[adcDriverADC(adcp) - 1];
+    switch (err) {
+        case ADC_ERR_DMAFAILURE:
+            health->dma_failures++;
+            break;
+        case ADC_ERR_OVERFLOW:
+            health->overflows++;
+            break;
         default:
-            return ANALOG_RAW_MAX_VALUE;
+            health->other_errors++;
+            break;
+    }
+    osalSysUnlockFromISR();
+}
+
+// stop and start a driver again, which also runs its self-calibration
+static void adcRestartDriver(uint8_t buffer){
+    adcStop(adc_drivers[buffer]);
+    adcStart(adc_drivers[buffer], NULL);
+#ifdef ADC_DRIFT_COMPENSATION
+    if (buffer == 0){
+        adcEnableInternalChannels();
+    }
+#endif
+}
+
+#ifdef ADC_CONTINUOUS_SCAN
+// restart the acquisition after a frame wasn't finished in time
+/* it isn't known which adc fell behind, so every adc in use is stopped and started again */
+static void adcRecoverAcquisition(void){
+    const uint8_t hand = adc_hand->hand;
+
+#ifdef ADC_TIMER_TRIGGER
+    // stop triggering conversions, the timer and multiplexer streams are restarted with the adcs
+    TIM3->CR1 = 0;
+#endif
+    for (uint8_t i = 0; i < N_ADC_BUFFERS; i++){
+        if (adc_buffer_length[hand][i] == 0){
+            continue;
+        }
+        adcStopConversion(adc_drivers[i]);
+        adcRestartDriver(i);
+        adc_health[i * ADC_ADCS_PER_BUFFER].timeouts++;
+        adc_health[i * ADC_ADCS_PER_BUFFER].restarts++;
+    }
+    adcStartContinuousScan();
+}
+#else
+// restart the acquisition after a frame wasn't finished in time
+/* the frame being captured is dropped, the adcs which are still converting lost their completion
+and are stopped and started again, an adc stopped by an error has already been counted */
+static void adcRecoverAcquisition(void){
+    const uint8_t hand = adc_hand->hand;
+    uint8_t stalled = 0; // one bit per buffer
+
+    osalSysLock();
+    if (adcManager.capturing){
+        for (uint8_t i = 0; i < N_ADC_BUFFERS; i++){
+            if (adc_buffer_length[hand][i] != 0 && adc_drivers[i]->state == ADC_ACTIVE){
+                adcStopConversionI(adc_drivers[i]);
+                stalled |= (1 << i);
+            }
+        }
+        adcManager.capturing = false;
+        adcManager.completedConversions = 0;
+#ifdef ADC_DIRECT_OVERSAMPLE
+        memset(adcManager.directSum, 0, sizeof(adcManager.directSum));
+        memset(adcManager.directSamples, 0, sizeof(adcManager.directSamples));
+#endif
+    }
+    osalSysUnlock();
+
+    for (uint8_t i = 0; i < N_ADC_BUFFERS; i++){
+        if (stalled & (1 << i)){
+            adcRestartDriver(i);
+            adc_health[i * ADC_ADCS_PER_BUFFER].timeouts++;
+            adc_health[i * ADC_ADCS_PER_BUFFER].restarts++;
+        }
+    }
+
+#ifdef ANALOG_SOF_SYNC
+    // free run until the start of frame is seen again
+    adcManager.sofSynced = false;
+    adcInstallSofHook();
+#endif
+    adcStartFrameCapture();
+}
+#endif
+
+// error counters of an adc (1-4)
+bool adcGetHealth(uint8_t adc, adc_health_t *health){
+    if (adc < 1 || adc > 4){
+        return false;
     }
+    osalSysLock();
+    memcpy(health, &adc_health[adc - 1], sizeof(adc_health_t));
+    osalSysUnlock();
+    return true;
+}
+
+#ifdef ADC_DRIFT_COMPENSATION
+// enable VREFINT and the temperature sensor, and wait for them to start up
+static void adcEnableInternalChannels(void){
+    adcSTM32EnableVREF(&ADCD1);
+    adcSTM32EnableTS(&ADCD1);
+    wait_us(20);
+}
+
+// convert VREFINT and the temperature sensor, the adcs must not be capturing
+static bool adcMeasureDrift(void){
+    if (adcConvert(&ADCD1, &adcDriftGroup, adc_drift_samples, 1) != MSG_OK){
+        return false;
+    }
+    const int32_t vrefint = adc_drift_samples[0];
+    const int32_t sensor  = adc_drift_samples[ADC_ADCS_PER_BUFFER];
+    if (vrefint == 0 || ADC_TS_CAL2 == ADC_TS_CAL1){
+        return false;
+    }
+
+    // VREFINT gives the supply, the temperature sensor is scaled to what it reads at 3.3V
+    adc_drift.vdda = (uint16_t) ((3300 * (int32_t) ADC_VREFINT_CAL) / vrefint);
+    const int32_t sensor_cal = (sensor * (int32_t) ADC_VREFINT_CAL) / vrefint;
+    adc_drift.temperature = (int16_t) (300 + ((sensor_cal - (int32_t) ADC_TS_CAL1) * 800) / ((int32_t) ADC_TS_CAL2 - (int32_t) ADC_TS_CAL1));
+    return true;
+}
+
+// gain which undoes the change of the magnet strength since boot
+/* the hall sensors are supplied from VDDA like the adcs, so supply changes cancel out in the samples */
+static void adcUpdateDriftGain(void){
+    const int32_t delta = adc_drift.temperature - adc_drift.reference;
+    const int32_t gain = ANALOG_GAIN_UNITY - (int32_t) (((int64_t) ANALOG_GAIN_UNITY * ADC_DRIFT_MAGNET_TEMPCO * delta) / 10000000);
+    adc_drift.gain = (uint16_t) MAX(ANALOG_GAIN_UNITY * 3 / 4, MIN(gain, ANALOG_GAIN_UNITY * 5 / 4));
+}
+
+// run the self-calibration of every adc again (adcStart calibrates while the adc is disabled)
+static void adcRecalibrate(void){
+    for (uint8_t i = 0; i < N_ADC_BUFFERS; i++){
+        adcRestartDriver(i);
+        adc_health[i * ADC_ADCS_PER_BUFFER].recalibrations++;
+    }
+}
+
+// sample the drift between two frames, every ADC_DRIFT_INTERVAL_MS
+/* the adcs are claimed by marking a capture as running, so the start of frame can't start one meanwhile,
+if a capture is already running the drift is sampled after the next frame instead */
+static void adcSampleDrift(void){
+    if (timer_elapsed32(adc_drift_timer) < ADC_DRIFT_INTERVAL_MS){
+        return;
+    }
+
+    osalSysLock();
+    const bool busy = adcManager.capturing;
+    adcManager.capturing = true;
+    osalSysUnlock();
+    if (busy){
+        return;
+    }
+
+    adc_drift_timer = timer_read32();
+    if (adcMeasureDrift()){
+        if (abs(adc_drift.temperature - adc_drift.calibrated) >= ADC_DRIFT_RECALIBRATE_TEMP){
+            adcRecalibrate();
+            adc_drift.calibrated = adc_drift.temperature;
+        }
+        adcUpdateDriftGain();
+    }
+
+    adcManager.capturing = false;
+}
+
+// last measured supply, temperature and gain
+void adcGetDrift(adc_drift_t *drift){
+    osalSysLock();
+    memcpy(drift, &adc_drift, sizeof(adc_drift_t));
+    osalSysUnlock();
+}
+#endif
+
+// wait for the next finished frame and copy it out, without any correction
+/* the copy is done with interrupts locked so the callbacks can't swap the frame mid-copy,
+the acquisition is restarted if no frame is finished within ADC_WAIT_TIMEOUT_MS,
+without continuous acquisition the capture of the following frame is started before returning */
+static msg_t adcWaitForRawFrame(adc_frame_t *frame){
+
+    // a stalled acquisition costs one frame instead of hanging the scan
+    while (chBSemWaitTimeout(&adcManager.frameSem, TIME_MS2I(ADC_WAIT_TIMEOUT_MS)) == MSG_TIMEOUT){
+        adcRecoverAcquisition();
+    }
+
+    osalSysLock();
+    memcpy(frame, &adcManager.frameBuffer[adcManager.frameReady], sizeof(adc_frame_t));
+    osalSysUnlock();
+
+#ifdef ADC_DRIFT_COMPENSATION
+    adcSampleDrift();
+#endif
+
+#ifdef ANALOG_SOF_SYNC
+    if (!adcManager.sofSynced){
+        adcStartFrameCapture();
+    }
+#elif !defined(ADC_CONTINUOUS_SCAN)
+    adcStartFrameCapture();
+#endif
+
+    return MSG_OK;
+}
+
+#ifdef ADC_CROSSTALK_COMPENSATION
+// previous column of a frame, in the direction the frame was captured
+/* the first column follows the last column of the previous frame */
+static uint8_t adcPreviousStep(uint8_t step, bool reversed){
+    if (reversed){
+        return (step + 1) % MATRIX_COLS;
+    }
+    return (step + MATRIX_COLS - 1) % MATRIX_COLS;
+}
+
+// subtract the carry-over from the previous column of every multiplexer row
+/* measured = real + coupling * (previous - real), so real ~ measured - coupling * (previous - measured) */
+static void adcCompensateCrosstalk(adc_frame_t *frame){
+    const uint8_t row_offset = adc_hand->row_offset;
+
+    for (uint8_t current_row = 0; current_row < ROWS_PER_HAND; current_row++){
+        if (adc_crosstalk[current_row] == 0 || adc_row_map[current_row + row_offset].adc == 0){
+            continue;
+        }
+
+        adcsample_t measured[MATRIX_COLS];
+        memcpy(measured, frame->sample[current_row], sizeof(measured));
+
+        for (uint8_t step = 0; step < MATRIX_COLS; step++){
+            uint8_t col = graycode_col(step);
+            uint8_t previous = graycode_col(adcPreviousStep(step, frame->reversed));
+            int32_t carry = ((int32_t) adc_crosstalk[current_row] * ((int32_t) measured[previous] - measured[col])) / (1 << 12);
+            frame->sample[current_row][col] = (adcsample_t) MAX(0, MIN((int32_t) measured[col] - carry, UINT16_MAX));
+        }
+    }
+}
+
+// capture in progress, started by adcCrosstalkStart and advanced one frame at a time by adcCrosstalkStep
+static struct {
+    uint8_t direction;
+    uint8_t frames; // frames summed in the current direction
+    uint32_t sum[2][ROWS_PER_HAND][MATRIX_COLS];
+} adc_crosstalk_capture;
+
+// solve the coupling of every row from the sums of both directions
+static bool adcSolveCrosstalk(void){
+    uint32_t (*sum)[ROWS_PER_HAND][MATRIX_COLS] = adc_crosstalk_capture.sum;
+    const uint8_t row_offset = adc_hand->row_offset;
+
+    bool valid = true;
+    for (uint8_t current_row = 0; current_row < ROWS_PER_HAND; current_row++){
+        adc_crosstalk[current_row] = 0;
+        if (adc_row_map[current_row + row_offset].adc == 0){
+            continue;
+        }
+
+        int64_t numerator = 0;
+        int64_t denominator = 0;
+        for (uint8_t step = 0; step < MATRIX_COLS; step++){
+            uint8_t col = graycode_col(step);
+            uint8_t forward = graycode_col(adcPreviousStep(step, false));
+            uint8_t backward = graycode_col(adcPreviousStep(step, true));
+
+            // difference of the column between directions, and of the columns before it (both in frames * counts)
+            int32_t measured = (int32_t) sum[0][current_row][col] - (int32_t) sum[1][current_row][col];
+            int32_t previous = 
+                ((int32_t) sum[0][current_row][forward]  + (int32_t) sum[1][current_row][forward]) / 2 - 
+                ((int32_t) sum[0][current_row][backward] + (int32_t) sum[1][current_row][backward]) / 2;
+
+            numerator   += (int64_t) measured * previous;
+            denominator += (int64_t) previous * previous;
+        }
+
+        if (denominator == 0){
+            continue;
+        }
+        int64_t coupling = (numerator * (1 << 12)) / denominator;
+        coupling = MAX(-ADC_CROSSTALK_MAX, MIN(coupling, ADC_CROSSTALK_MAX));
+
+        // the reversed frames must match the forward frames once the coupling is removed
+        bool matches = true;
+        for (uint8_t step = 0; step < MATRIX_COLS; step++){
+            uint8_t col = graycode_col(step);
+            uint8_t forward = graycode_col(adcPreviousStep(step, false));
+            uint8_t backward = graycode_col(adcPreviousStep(step, true));
+
+            int32_t measured = (int32_t) sum[0][current_row][col] - (int32_t) sum[1][current_row][col];
+            int32_t previous = 
+                ((int32_t) sum[0][current_row][forward]  + (int32_t) sum[1][current_row][forward]) / 2 - 
+                ((int32_t) sum[0][current_row][backward] + (int32_t) sum[1][current_row][backward]) / 2;
+            int64_t residual = (int64_t) measured - (coupling * previous) / (1 << 12);
+
+            if (llabs(residual) > (int64_t) ADC_CROSSTALK_MAX_RESIDUAL * ADC_CROSSTALK_FRAMES){
+                matches = false;
+                break;
+            }
+        }
+
+        if (matches){
+            adc_crosstalk[current_row] = (int16_t) coupling;
+        }
+        else {
+            valid = false;
+        }
+    }
+
+    return valid;
+}
+
+
+// measure the coupling from the previous column of every multiplexer row
+/* keys must be at rest, frames are averaged in both scan directions:
+forward - backward = coupling * (previous forward - previous backward), solved by least squares over the columns.
+at rest both directions must then agree to within ADC_CROSSTALK_MAX_RESIDUAL, rows which don't
+(a key was pressed, or a column was stored in the wrong place) are left uncompensated.
+the coupling is cleared while the frames are summed, so they read uncompensated */
+void adcCrosstalkStart(void){
+    memset(&adc_crosstalk_capture, 0, sizeof(adc_crosstalk_capture));
+    memset(adc_crosstalk, 0, sizeof(adc_crosstalk));
+    adcManager.reverseNext = false;
+}
+
+// sum one frame, returns true once both directions are summed and *valid tells if every row was solved
+/* frames which were started in the other direction are skipped */
+bool adcCrosstalkStep(const adc_frame_t *frame, bool *valid){
+    const uint8_t direction = adc_crosstalk_capture.direction;
+    if (frame->reversed != direction){
+        return false;
+    }
+    for (uint8_t current_row = 0; current_row < ROWS_PER_HAND; current_row++){
+        for (uint8_t col = 0; col < MATRIX_COLS; col++){
+            adc_crosstalk_capture.sum[direction][current_row][col] += frame->sample[current_row][col];
+        }
+    }
+    if (++adc_crosstalk_capture.frames < ADC_CROSSTALK_FRAMES){
+        return false;
+    }
+
+    adc_crosstalk_capture.frames = 0;
+    adc_crosstalk_capture.direction++;
+    if (adc_crosstalk_capture.direction < 2){
+        adcManager.reverseNext = true;
+        return false;
+    }
+    adcManager.reverseNext = false;
+    *valid = adcSolveCrosstalk();
+    return true;
+}
+
+// measure the coupling, waiting on the frames (at startup)
+bool adcCalibrateCrosstalk(void){
+    static adc_frame_t frame;
+    bool valid = false;
+
+    adcCrosstalkStart();
+    do {
+        adcWaitForFrame(&frame);
+    } while (!adcCrosstalkStep(&frame, &valid));
+    return valid;
+}
+
+// coupling of a row (absolute row, 0 if it is on the other hand) in Q12
+int16_t adcGetCrosstalk(uint8_t row){
+    const uint8_t row_offset = adc_hand->row_offset;
+    if (row < row_offset || row >= row_offset + ROWS_PER_HAND){
+        return 0;
+    }
+    return adc_crosstalk[row - row_offset];
+}
+#endif
+
+// wait for the next finished frame and copy it out
+msg_t adcWaitForFrame(adc_frame_t *frame){
+    msg_t msg = adcWaitForRawFrame(frame);
+#ifdef ADC_CROSSTALK_COMPENSATION
+    adcCompensateCrosstalk(frame);
+#endif
+    return msg;
 }
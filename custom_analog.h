@@ -3,21 +3,237 @@
 
 #include "hal.h"
 
+#if defined(ADC_CIRCULAR_DMA) && defined(ADC_TIMER_TRIGGER)
+#    error "ADC_CIRCULAR_DMA and ADC_TIMER_TRIGGER can't be enabled at the same time"
+#endif
+#if defined(ADC_DUAL_MODE) && (defined(ADC_CIRCULAR_DMA) || defined(ADC_TIMER_TRIGGER))
+#    error "ADC_DUAL_MODE only supports the per-column acquisition"
+#endif
+#if defined(ADC_RUNTIME_SAMPLING) && (defined(ADC_CIRCULAR_DMA) || defined(ADC_TIMER_TRIGGER))
+#    error "ADC_RUNTIME_SAMPLING only supports the per-column acquisition"
+#endif
+#if defined(ANALOG_SOF_SYNC) && (defined(ADC_CIRCULAR_DMA) || defined(ADC_TIMER_TRIGGER))
+#    error "ANALOG_SOF_SYNC only supports the per-column acquisition"
+#endif
+#if defined(ADC_CROSSTALK_COMPENSATION) && (defined(ADC_CIRCULAR_DMA) || defined(ADC_TIMER_TRIGGER))
+#    error "ADC_CROSSTALK_COMPENSATION only supports the per-column acquisition"
+#endif
+#if defined(ADC_DIRECT_OVERSAMPLE) && (defined(ADC_CIRCULAR_DMA) || defined(ADC_TIMER_TRIGGER))
+#    error "ADC_DIRECT_OVERSAMPLE only supports the per-column acquisition"
+#endif
+#if defined(ADC_DRIFT_COMPENSATION) && (defined(ADC_CIRCULAR_DMA) || defined(ADC_TIMER_TRIGGER))
+#    error "ADC_DRIFT_COMPENSATION only supports the per-column acquisition"
+#endif
+// Both continuous modes deliver whole frames to the scan loop
+#if defined(ADC_CIRCULAR_DMA) || defined(ADC_TIMER_TRIGGER)
+#    define ADC_CONTINUOUS_SCAN
+#endif
+// Frames are captured whether or not the scan loop has taken the last one, so it can miss frames
+/* the per-column acquisition otherwise starts the next frame when the scan loop takes one */
+#if defined(ADC_CONTINUOUS_SCAN) || defined(ANALOG_SOF_SYNC)
+#    define ADC_FREE_RUNNING
+#endif
+
+// Depth of each sample buffer
+/* circular mode uses two halves (one column each),
+timer mode holds a whole frame (one sample per column) */
+#if defined(ADC_TIMER_TRIGGER)
+#    define ADC_BUFFER_DEPTH MATRIX_COLS
+#elif defined(ADC_CIRCULAR_DMA)
+#    define ADC_BUFFER_DEPTH 2
+#else
+#    define ADC_BUFFER_DEPTH 1
+#endif
+
+// Empty layouts for a hand without multiplexers or direct pins
+#ifndef ADC_LAYOUT_RIGHT
+#    define ADC_LAYOUT_RIGHT(X, arg)
+#endif
+#ifndef ADC_DIRECT_LAYOUT_LEFT
+#    define ADC_DIRECT_LAYOUT_LEFT(X, arg)
+#endif
+#ifndef ADC_DIRECT_LAYOUT_RIGHT
+#    define ADC_DIRECT_LAYOUT_RIGHT(X, arg)
+#endif
+
+// Counting helpers, expanded over the layout tables in config.h
+#define ADC_LAYOUT_COUNT_ENTRY(__adc, __adcn, __rank, __channel, __row) + ((__adcn) == (__adc))
+#define ADC_LAYOUT_RANK_ENTRY(__adc, __adcn, __rank, __channel, __row) + (((__adcn) == (__adc)) ? (__rank) : 0)
+#define ADC_DIRECT_COUNT_ENTRY(__adc, __adcn, __channel, __row, __col) + ((__adcn) == (__adc))
+// number of multiplexers read by an ADC
+#define ADC_MUX_COUNT(__layout, __adc) (0 __layout(ADC_LAYOUT_COUNT_ENTRY, __adc))
+// sum of the ranks on an ADC, used to check the ranks are 0,1,2...
+#define ADC_RANK_SUM(__layout, __adc) (0 __layout(ADC_LAYOUT_RANK_ENTRY, __adc))
+// number of direct pins read by an ADC
+#define ADC_DIRECT_COUNT(__dlayout, __adc) (0 __dlayout(ADC_DIRECT_COUNT_ENTRY, __adc))
+// number of conversions in the sequence of an ADC (direct pins are converted one at a time)
+#define ADC_SEQUENCE_LENGTH(__layout, __dlayout, __adc) \
+    (ADC_MUX_COUNT(__layout, __adc) + (ADC_DIRECT_COUNT(__dlayout, __adc) > 0))
+#define ADC_MAX(__a, __b) (((__a) > (__b)) ? (__a) : (__b))
+
+// Sample buffers
+/* dual mode shares one buffer between a master/slave pair,
+the samples of a pair are interleaved and the pair converts the longer of the two sequences */
+#ifdef ADC_DUAL_MODE
+#    define ADC_ADCS_PER_BUFFER 2
+#    define ADC_BUFFER_LENGTH(__layout, __dlayout, __buffer) ADC_MAX( \
+        ADC_SEQUENCE_LENGTH(__layout, __dlayout, (__buffer) * 2 + 1), \
+        ADC_SEQUENCE_LENGTH(__layout, __dlayout, (__buffer) * 2 + 2)  \
+    )
+#else
+#    define ADC_ADCS_PER_BUFFER 1
+#    define ADC_BUFFER_LENGTH(__layout, __dlayout, __buffer) \
+        ADC_SEQUENCE_LENGTH(__layout, __dlayout, (__buffer) + 1)
+#endif
+#define N_ADC_BUFFERS (4 / ADC_ADCS_PER_BUFFER)
+#define ADC_BUFFER_INDEX(__adc) (((__adc) - 1) / ADC_ADCS_PER_BUFFER)
+#define ADC_BUFFER_SIDE(__adc)  (((__adc) - 1) % ADC_ADCS_PER_BUFFER)
+
+// Number of conversion callbacks per column (one per buffer in use)
+/* in dual mode buffers 2 and 3 don't exist and always have a length of zero */
+#define ADC_USED_BUFFERS(__layout, __dlayout) (             \
+    (ADC_BUFFER_LENGTH(__layout, __dlayout, 0) > 0) +       \
+    (ADC_BUFFER_LENGTH(__layout, __dlayout, 1) > 0) +       \
+    (ADC_BUFFER_LENGTH(__layout, __dlayout, 2) > 0) +       \
+    (ADC_BUFFER_LENGTH(__layout, __dlayout, 3) > 0)         \
+)
+#define N_ADC_COMPLETIONS       ADC_USED_BUFFERS(ADC_LAYOUT_LEFT, ADC_DIRECT_LAYOUT_LEFT)
+#define N_ADC_COMPLETIONS_RIGHT ADC_USED_BUFFERS(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT)
+
 // Type Definitions
 typedef struct {
-    adcsample_t sampleBuffer0[MAX_MUXES_PER_ADC];
-    adcsample_t sampleBuffer1[MAX_MUXES_PER_ADC];
-    adcsample_t sampleBuffer2[MAX_MUXES_PER_ADC];
-    adcsample_t sampleBuffer3[MAX_MUXES_PER_ADC];
-    adcsample_t sampleBuffer4[MAX_MUXES_PER_ADC];
-    adcsample_t sampleBuffer5[MAX_MUXES_PER_ADC];
+    // number of the frame, incremented for every finished frame
+    uint32_t sequence;
+#ifdef ANALOG_IDLE_SKIP
+    // every sample was inside its rest window
+    bool quiet;
+#endif
+#ifdef ADC_CROSSTALK_COMPENSATION
+    // the columns were converted in reverse scan order
+    bool reversed;
+#endif
+    adcsample_t sample[ROWS_PER_HAND][MATRIX_COLS];
+} adc_frame_t;
+
+typedef struct {
+    adcsample_t sampleBuffer[N_ADC_BUFFERS][ADC_ADCS_PER_BUFFER * MAX_MUXES_PER_ADC * ADC_SAMPLES_PER_COLUMN * ADC_BUFFER_DEPTH];
     volatile int completedConversions;
-    semaphore_t sem;
+#ifdef ADC_CIRCULAR_DMA
+    // which half of the sample buffers was written last
+    volatile uint8_t bufferSlot;
+    // half of its buffer each direct pin ADC converts into next, they only convert on the columns of their pins
+    uint8_t directSlot[N_ADC_BUFFERS];
+    // the first column after a start converts on every ADC, so every stream starts in step
+    bool directStarting;
+#endif
+#ifndef ADC_TIMER_TRIGGER
+    // position in the (graycoded) column sequence
+    volatile uint8_t currentStep;
+#endif
+#ifndef ADC_CONTINUOUS_SCAN
+    // set while the callbacks are capturing a frame
+    volatile bool capturing;
+#endif
+#ifdef ANALOG_SOF_SYNC
+    // captures are being started by the USB start of frame
+    volatile bool sofSynced;
+#endif
+#ifdef ADC_CROSSTALK_COMPENSATION
+    // scan direction of the frame being captured, and of the next one
+    volatile bool reverse;
+    volatile bool reverseNext;
+#endif
+#ifdef ADC_DIRECT_OVERSAMPLE
+    // buffers which read direct pins, and the direct pin (column) each one converts in the current slot
+    uint8_t directBuffers;
+    uint8_t directSlotCol[N_ADC_BUFFERS];
+    uint8_t directCursor[N_ADC_BUFFERS];
+    // sum and number of the samples of each direct pin in the current frame, indexed by column
+    uint32_t directSum[MATRIX_COLS];
+    uint8_t directSamples[MATRIX_COLS];
+#endif
+    // frame being written by the callbacks, and the last finished frame
+    volatile uint8_t frameWrite;
+    volatile uint8_t frameReady;
+    uint32_t frameSequence;
+    adc_frame_t frameBuffer[2];
+    binary_semaphore_t frameSem;
+#ifdef ANALOG_IDLE_SKIP
+    // rest window of every key, and whether a sample of the current frame left its window
+    adcsample_t idleLow[ROWS_PER_HAND][MATRIX_COLS];
+    adcsample_t idleHigh[ROWS_PER_HAND][MATRIX_COLS];
+    volatile bool idleArmed;
+    volatile bool frameExcursion;
+#endif
 } ADCManager;
 
+#ifdef ADC_RUNTIME_SAMPLING
+// Sampling settings of one ADC
+typedef struct {
+    uint8_t sampling_time; // ADC_SMPR_SMP_1P5 ... ADC_SMPR_SMP_601P5
+    uint8_t resolution;    // 12 or 10 bits
+    uint16_t noise;        // peak to peak noise measured by the last tune (12-bit counts)
+} adc_sampling_t;
+#endif
+
+#ifdef ADC_DRIFT_COMPENSATION
+// Supply and temperature drift
+typedef struct {
+    uint16_t vdda;        // supply of the adcs (mV)
+    int16_t temperature;  // temperature of the mcu (0.1 degrees)
+    int16_t reference;    // temperature the gain is relative to (at boot)
+    int16_t calibrated;   // temperature of the last adc self-calibration
+    uint16_t gain;        // correction of the change from rest (Q12)
+} adc_drift_t;
+#endif
+
+// Error counters of one ADC
+/* in dual mode the counters of a pair are kept on its master */
+typedef struct {
+    uint16_t overflows;    // conversions overwritten before they were read
+    uint16_t dma_failures;
+    uint16_t other_errors; // watchdogs and unknown errors
+    uint16_t timeouts;     // frames the adc was still converting when the wait timed out
+    uint16_t restarts;     // times the adc was stopped and started again after a timeout
+    uint16_t recalibrations; // self-calibrations run again for the drift (not a fault)
+} adc_health_t;
+
 // Function Prototypes
 void initADCGroups(void);
+void adcErrorCallback(ADCDriver *adcp, adcerror_t err);
+#ifndef ADC_CONTINUOUS_SCAN
 void adcCompleteCallback(ADCDriver *adcp);
-msg_t adcStartAllConversions(uint8_t current_col);
-msg_t adcWaitForConversions(void);
-adcsample_t getADCSample(uint8_t current_row);
\ No newline at end of file
+#endif
+#ifdef ADC_CIRCULAR_DMA
+void adcCircularCallback(ADCDriver *adcp);
+#endif
+#ifdef ADC_TIMER_TRIGGER
+void adcTimerCallback(ADCDriver *adcp);
+#endif
+#ifdef ADC_CONTINUOUS_SCAN
+msg_t adcStartContinuousScan(void);
+#else
+msg_t adcStartFrameCapture(void);
+#endif
+msg_t adcWaitForFrame(adc_frame_t *frame);
+bool adcGetHealth(uint8_t adc, adc_health_t *health);
+#ifdef ADC_RUNTIME_SAMPLING
+bool adcSetSampling(uint8_t adc, uint8_t sampling_time, uint8_t resolution);
+bool adcGetSampling(uint8_t adc, adc_sampling_t *sampling);
+void adcTuneSamplingStart(const matrix_row_t *mask);
+bool adcTuneSamplingStep(const adc_frame_t *frame);
+void adcTuneSampling(const matrix_row_t *mask);
+#endif
+#ifdef ANALOG_IDLE_SKIP
+void adcArmIdleWindows(const adcsample_t low[ROWS_PER_HAND][MATRIX_COLS], const adcsample_t high[ROWS_PER_HAND][MATRIX_COLS]);
+bool adcIdleArmed(void);
+#endif
+#ifdef ADC_CROSSTALK_COMPENSATION
+void adcCrosstalkStart(void);
+bool adcCrosstalkStep(const adc_frame_t *frame, bool *valid);
+bool adcCalibrateCrosstalk(void);
+int16_t adcGetCrosstalk(uint8_t row);
+#endif
+#ifdef ADC_DRIFT_COMPENSATION
+void adcGetDrift(adc_drift_t *drift);
+#endif
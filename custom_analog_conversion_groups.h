@@ -5,109 +5,442 @@
 
 #include "hal.h"
 
-// print errors to the console
-void adcErrorCallback(ADCDriver *adcp, adcerror_t err) {
-    (void)adcp; // Unused parameter
-    osalSysLockFromISR();
-    switch (err) {
-        case ADC_ERR_DMAFAILURE:
-            uprintf("ADC ERROR: DMA failure.\n");
-            break;
-        case ADC_ERR_OVERFLOW:
-            uprintf("ADC ERROR: Overflow.\n");
-            break;
-        case ADC_ERR_AWD1:
-            uprintf("ADC ERROR: Watchdog 1 triggered.\n");
-            break;
-        case ADC_ERR_AWD2:
-            uprintf("ADC ERROR: Watchdog 2 triggered.\n");
-            break;
-        case ADC_ERR_AWD3:
-            uprintf("ADC ERROR: Watchdog 3 triggered.\n");
-            break;
-        default:
-            uprintf("ADC ERROR: Unknown error.\n");
-            break;
-    }
-    osalSysUnlockFromISR();
+// Groups are kept in RAM when the sampling time and resolution can be changed at runtime
+#ifdef ADC_RUNTIME_SAMPLING
+# define ADC_GROUP_CONST
+#else
+# define ADC_GROUP_CONST const
+#endif
+
+// Helpers to unpack the argument passed through the layout tables
+#define ADC_ARG_0(__a, __b) __a
+#define ADC_ARG_1(__a, __b) __b
+
+// Sampling time of every channel
+/* only the channels in the sequence are converted, so setting all of them is harmless */
+#define ADC_SMPR_ALL(__smp) {                                                       \
+    ADC_SMPR1_SMP_AN1(__smp)  | ADC_SMPR1_SMP_AN2(__smp)  | ADC_SMPR1_SMP_AN3(__smp)  | \
+    ADC_SMPR1_SMP_AN4(__smp)  | ADC_SMPR1_SMP_AN5(__smp)  | ADC_SMPR1_SMP_AN6(__smp)  | \
+    ADC_SMPR1_SMP_AN7(__smp)  | ADC_SMPR1_SMP_AN8(__smp)  | ADC_SMPR1_SMP_AN9(__smp),   \
+    ADC_SMPR2_SMP_AN10(__smp) | ADC_SMPR2_SMP_AN11(__smp) | ADC_SMPR2_SMP_AN12(__smp) | \
+    ADC_SMPR2_SMP_AN13(__smp) | ADC_SMPR2_SMP_AN14(__smp) | ADC_SMPR2_SMP_AN15(__smp) | \
+    ADC_SMPR2_SMP_AN16(__smp) | ADC_SMPR2_SMP_AN17(__smp) | ADC_SMPR2_SMP_AN18(__smp),  \
 }
 
-static const ADCConversionGroup adcConversionGroup1 = { // Channel 1 only
-    .circular     = false,
-    .num_channels = 1U,
-    .end_cb       = adcCompleteCallback,
-    .error_cb     = adcErrorCallback,
-    .cfgr         = ADC_RESOLUTION,
-    .tr1          = ADC_TR_DISABLED,
-    .tr2          = ADC_TR_DISABLED,
-    .tr3          = ADC_TR_DISABLED,
-    .awd2cr       = 0U,
-    .awd3cr       = 0U,
-    .smpr         = {
-        ADC_SMPR1_SMP_AN1(ADC_SAMPLING_TIME),
+// Position of a conversion in the sequence registers
+/* SQR1 holds SQ1-SQ4 (after the length field), SQR2 SQ5-SQ9, SQR3 SQ10-SQ14, SQR4 SQ15-SQ16 */
+#define ADC_SQR_POSITION(__reg, __pos, __channel) \
+    ((((__pos) + 1U) / 5U == (__reg)) ? ((uint32_t)(__channel) << ((((__pos) + 1U) % 5U) * 6U)) : 0U)
+// Converts __channel at every position from __from up to (not including) __to
+#define ADC_SQR_FILL_AT(__reg, __pos, __from, __to, __channel) \
+    ((((__pos) >= (__from)) && ((__pos) < (__to))) ? ADC_SQR_POSITION(__reg, __pos, __channel) : 0U)
+#define ADC_SQR_FILL(__reg, __from, __to, __channel) ( \
+    ADC_SQR_FILL_AT(__reg,  0U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg,  1U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg,  2U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg,  3U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg,  4U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg,  5U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg,  6U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg,  7U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg,  8U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg,  9U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg, 10U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg, 11U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg, 12U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg, 13U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg, 14U, __from, __to, __channel) | \
+    ADC_SQR_FILL_AT(__reg, 15U, __from, __to, __channel) \
+)
+
+// Sequence which converts the same channel ADC_SAMPLES_PER_COLUMN times
+#define ADC_SQR1_REPEAT(__channel) ADC_SQR_FILL(0U, 0U, ADC_SAMPLES_PER_COLUMN, __channel)
+#define ADC_SQR2_REPEAT(__channel) ADC_SQR_FILL(1U, 0U, ADC_SAMPLES_PER_COLUMN, __channel)
+#define ADC_SQR_REPEAT(__channel) {                                                  \
+    ADC_SQR1_REPEAT(__channel),                                                     \
+    ADC_SQR2_REPEAT(__channel),                                                     \
+}
+
+// Sequence of the multiplexers on an ADC, each one is converted ADC_SAMPLES_PER_COLUMN times in a row
+#define ADC_SQR_MUX_ENTRY(__arg, __adcn, __rank, __channel, __row)                  \
+    | (((__adcn) == ADC_ARG_1 __arg) ? ADC_SQR_FILL(ADC_ARG_0 __arg,                \
+        (__rank) * ADC_SAMPLES_PER_COLUMN, ((__rank) + 1) * ADC_SAMPLES_PER_COLUMN, __channel) : 0U)
+#define ADC_SQR_MUX(__layout, __adc, __reg) (0U __layout(ADC_SQR_MUX_ENTRY, (__reg, __adc)))
+
+// Channel of the direct pin an ADC reads on a column, or the padding channel if there isn't one
+#define ADC_DIRECT_CHANNEL_ENTRY(__arg, __adcn, __channel, __row, __col) \
+    | ((((__adcn) == ADC_ARG_0 __arg) && ((__col) == ADC_ARG_1 __arg)) ? (__channel) : 0U)
+#define ADC_DIRECT_MATCH_ENTRY(__arg, __adcn, __channel, __row, __col) \
+    + (((__adcn) == ADC_ARG_0 __arg) && ((__col) == ADC_ARG_1 __arg))
+#define ADC_DIRECT_CHANNEL(__dlayout, __adc, __col) (                               \
+    (0U __dlayout(ADC_DIRECT_CHANNEL_ENTRY, (__adc, __col))) |                      \
+    (((0 __dlayout(ADC_DIRECT_MATCH_ENTRY, (__adc, __col))) == 0) ? ADC_PADDING_CHANNEL : 0U) \
+)
+
+// Sequence of an ADC, direct pin ADCs start on the pin of column 0
+#define ADC_SQR_SEQUENCE(__layout, __dlayout, __adc, __reg) (                       \
+    ADC_SQR_MUX(__layout, __adc, __reg) |                                           \
+    ((ADC_DIRECT_COUNT(__dlayout, __adc) > 0) ?                                     \
+        ADC_SQR_FILL(__reg, 0U, ADC_SAMPLES_PER_COLUMN, ADC_DIRECT_CHANNEL(__dlayout, __adc, 0)) : 0U) \
+)
+
+// Settings which depend on the acquisition mode
+#if defined(ADC_TIMER_TRIGGER)
+// External trigger sources for TIM3_TRGO (RM0316, ADC external triggers for regular channels)
+# define ADC12_EXTSEL_TIM3_TRGO 4U
+# define ADC34_EXTSEL_TIM3_TRGO 11U
+
+# if ADC_SAMPLES_PER_COLUMN > 1
+#    error "Timer triggered direct pins only support one sample per column"
+# endif
+
+/* Direct pins - discontinuous mode converts one entry of the sequence per trigger
+the sequence covers half a frame (steps 0-7 = cols 0,1,3,2,6,7,5,4) and is converted twice per frame,
+so the direct pins must be on columns reached in the first half of the graycoded sequence */
+# define ADC_GRAYCODE(__step) ((__step) ^ ((__step) >> 1))
+# define ADC_SQR_STEP(__dlayout, __adc, __reg, __step)                              \
+    (((__step) < (MATRIX_COLS / 2)) ?                                               \
+        ADC_SQR_POSITION(__reg, __step, ADC_DIRECT_CHANNEL(__dlayout, __adc, ADC_GRAYCODE(__step))) : 0U)
+# define ADC_SQR_STEPS(__dlayout, __adc, __reg) ( \
+    ADC_SQR_STEP(__dlayout, __adc, __reg,  0U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg,  1U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg,  2U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg,  3U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg,  4U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg,  5U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg,  6U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg,  7U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg,  8U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg,  9U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg, 10U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg, 11U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg, 12U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg, 13U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg, 14U) | \
+    ADC_SQR_STEP(__dlayout, __adc, __reg, 15U) \
+)
+
+# define ADC_IS_DIRECT(__dlayout, __adc) (ADC_DIRECT_COUNT(__dlayout, __adc) > 0)
+// one conversion (of the whole sequence) per trigger, the DMA buffer holds a whole frame
+# define ADC_GROUP_CIRCULAR true
+# define ADC_GROUP_END_CB   adcTimerCallback
+# define ADC_GROUP_CFGR(__dlayout, __adc) (                                         \
+    ADC_RESOLUTION |                                                                \
+    ADC_CFGR_EXTEN_RISING |                                                         \
+    ADC_CFGR_EXTSEL_SRC(((__adc) <= 2) ? ADC12_EXTSEL_TIM3_TRGO : ADC34_EXTSEL_TIM3_TRGO) | \
+    (ADC_IS_DIRECT(__dlayout, __adc) ? (ADC_CFGR_DISCEN_ENABLED | ADC_CFGR_DISCNUM_VAL(0U)) : 0U) \
+)
+# define ADC_GROUP_NUM_CHANNELS(__layout, __dlayout, __adc)                         \
+    (ADC_IS_DIRECT(__dlayout, __adc) ? (MATRIX_COLS / 2) :                          \
+        (ADC_SEQUENCE_LENGTH(__layout, __dlayout, __adc) * ADC_SAMPLES_PER_COLUMN))
+# define ADC_GROUP_SQR(__layout, __dlayout, __adc, __reg)                           \
+    (ADC_IS_DIRECT(__dlayout, __adc) ? ADC_SQR_STEPS(__dlayout, __adc, __reg) :     \
+        ADC_SQR_MUX(__layout, __adc, __reg))
+#elif defined(ADC_CIRCULAR_DMA)
+// the sequence of direct pin ADCs is rewritten on every column
+# define ADC_GROUP_CIRCULAR true
+# define ADC_GROUP_END_CB   adcCircularCallback
+# define ADC_GROUP_CFGR(__dlayout, __adc) ADC_RESOLUTION
+# define ADC_GROUP_NUM_CHANNELS(__layout, __dlayout, __adc) \
+    (ADC_SEQUENCE_LENGTH(__layout, __dlayout, __adc) * ADC_SAMPLES_PER_COLUMN)
+# define ADC_GROUP_SQR(__layout, __dlayout, __adc, __reg) ADC_SQR_SEQUENCE(__layout, __dlayout, __adc, __reg)
+#else
+// direct pin ADCs start the group of the column instead
+# define ADC_GROUP_CIRCULAR false
+# define ADC_GROUP_END_CB   adcCompleteCallback
+# define ADC_GROUP_CFGR(__dlayout, __adc) ADC_RESOLUTION
+# define ADC_GROUP_NUM_CHANNELS(__layout, __dlayout, __adc) \
+    (ADC_SEQUENCE_LENGTH(__layout, __dlayout, __adc) * ADC_SAMPLES_PER_COLUMN)
+# define ADC_GROUP_SQR(__layout, __dlayout, __adc, __reg) ADC_SQR_SEQUENCE(__layout, __dlayout, __adc, __reg)
+#endif
+
+#ifndef ADC_DUAL_MODE
+// Group which converts the whole sequence of one ADC
+# define ADC_GROUP(__layout, __dlayout, __adc)                                      \
+{                                                                                   \
+    .circular     = ADC_GROUP_CIRCULAR,                                             \
+    .num_channels = ADC_GROUP_NUM_CHANNELS(__layout, __dlayout, __adc),             \
+    .end_cb       = ADC_GROUP_END_CB,                                               \
+    .error_cb     = adcErrorCallback,                                               \
+    .cfgr         = ADC_GROUP_CFGR(__dlayout, __adc),                               \
+    .tr1          = ADC_TR_DISABLED,                                                \
+    .tr2          = ADC_TR_DISABLED,                                                \
+    .tr3          = ADC_TR_DISABLED,                                                \
+    .awd2cr       = 0U,                                                             \
+    .awd3cr       = 0U,                                                             \
+    .smpr         = ADC_SMPR_ALL(ADC_SAMPLING_TIME),                                \
+    .sqr          = {                                                               \
+        ADC_GROUP_SQR(__layout, __dlayout, __adc, 0U),                              \
+        ADC_GROUP_SQR(__layout, __dlayout, __adc, 1U),                              \
+        ADC_GROUP_SQR(__layout, __dlayout, __adc, 2U),                              \
+        ADC_GROUP_SQR(__layout, __dlayout, __adc, 3U),                              \
+    }                                                                               \
+}
+
+// Group which converts one direct pin, placed at the column of the pin
+# define ADC_DIRECT_GROUP_ENTRY(__arg, __adcn, __channel, __row, __col)             \
+[__col] = {                                                                         \
+    .circular     = false,                                                          \
+    .num_channels = ADC_SAMPLES_PER_COLUMN,                                         \
+    .end_cb       = adcCompleteCallback,                                            \
+    .error_cb     = adcErrorCallback,                                               \
+    .cfgr         = ADC_RESOLUTION,                                                 \
+    .tr1          = ADC_TR_DISABLED,                                                \
+    .tr2          = ADC_TR_DISABLED,                                                \
+    .tr3          = ADC_TR_DISABLED,                                                \
+    .awd2cr       = 0U,                                                             \
+    .awd3cr       = 0U,                                                             \
+    .smpr         = ADC_SMPR_ALL(ADC_SAMPLING_TIME),                                \
+    .sqr          = ADC_SQR_REPEAT(__channel)                                       \
+},
+
+// Group of each ADC, for each hand
+/* groups with no channels are never started */
+static ADC_GROUP_CONST ADCConversionGroup adcGroups[2][N_ADC_BUFFERS] = {
+    {
+        ADC_GROUP(ADC_LAYOUT_LEFT, ADC_DIRECT_LAYOUT_LEFT, 1),
+        ADC_GROUP(ADC_LAYOUT_LEFT, ADC_DIRECT_LAYOUT_LEFT, 2),
+        ADC_GROUP(ADC_LAYOUT_LEFT, ADC_DIRECT_LAYOUT_LEFT, 3),
+        ADC_GROUP(ADC_LAYOUT_LEFT, ADC_DIRECT_LAYOUT_LEFT, 4)
     },
-    .sqr          = {
-        ADC_SQR1_SQ1_N(ADC_CHANNEL_IN1),
+    {
+        ADC_GROUP(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 1),
+        ADC_GROUP(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 2),
+        ADC_GROUP(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 3),
+        ADC_GROUP(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 4)
     }
 };
 
-static const ADCConversionGroup adcConversionGroup2 = { // Channel 2 only
-    .circular     = false,
-    .num_channels = 1U,
-    .end_cb       = adcCompleteCallback,
-    .error_cb     = adcErrorCallback,
-    .cfgr         = ADC_RESOLUTION,
-    .tr1          = ADC_TR_DISABLED,
-    .tr2          = ADC_TR_DISABLED,
-    .tr3          = ADC_TR_DISABLED,
-    .awd2cr       = 0U,
-    .awd3cr       = 0U,
-    .smpr         = {
-        ADC_SMPR1_SMP_AN2(ADC_SAMPLING_TIME),
-    },
-    .sqr          = {
-        ADC_SQR1_SQ1_N(ADC_CHANNEL_IN2),
-    }
+# if !defined(ADC_CONTINUOUS_SCAN)
+// Group of each direct pin, indexed by column
+/* columns without a direct pin are left empty */
+static ADC_GROUP_CONST ADCConversionGroup adcDirectGroups[2][MATRIX_COLS] = {
+    { ADC_DIRECT_LAYOUT_LEFT(ADC_DIRECT_GROUP_ENTRY, 0) },
+    { ADC_DIRECT_LAYOUT_RIGHT(ADC_DIRECT_GROUP_ENTRY, 0) }
 };
+# endif
+#else
+// Regular simultaneous mode only (CCR MULTI[4:0] = 00110)
+# define ADC_CCR_DUAL_REGULAR_SIMULTANEOUS 6U
 
-static const ADCConversionGroup adcConversionGroup3 = { // Channel 3 only
-    .circular     = false,
-    .num_channels = 1U,
-    .end_cb       = adcCompleteCallback,
-    .error_cb     = adcErrorCallback,
-    .cfgr         = ADC_RESOLUTION,
-    .tr1          = ADC_TR_DISABLED,
-    .tr2          = ADC_TR_DISABLED,
-    .tr3          = ADC_TR_DISABLED,
-    .awd2cr       = 0U,
-    .awd3cr       = 0U,
-    .smpr         = {
-        ADC_SMPR1_SMP_AN3(ADC_SAMPLING_TIME),
+// Sequence of one side of a pair, padded to the length of the pair
+/* direct pin ADCs have no multiplexers, so they convert padding unless their pin is selected */
+# define ADC_SQR_DUAL(__layout, __adc, __length, __reg) (                          \
+    ADC_SQR_MUX(__layout, __adc, __reg) |                                           \
+    ADC_SQR_FILL(__reg, ADC_MUX_COUNT(__layout, __adc) * ADC_SAMPLES_PER_COLUMN,    \
+        (__length) * ADC_SAMPLES_PER_COLUMN, ADC_PADDING_CHANNEL)                   \
+)
+// Sequence of one side of a pair, with the direct pin __channel on ADC __adcn
+# define ADC_SQR_DUAL_DIRECT(__layout, __adc, __adcn, __channel, __length, __reg) \
+    (((__adc) == (__adcn)) ?                                                        \
+        (ADC_SQR_FILL(__reg, 0U, ADC_SAMPLES_PER_COLUMN, __channel) |               \
+         ADC_SQR_FILL(__reg, ADC_SAMPLES_PER_COLUMN,                                \
+            (__length) * ADC_SAMPLES_PER_COLUMN, ADC_PADDING_CHANNEL)) :            \
+        ADC_SQR_DUAL(__layout, __adc, __length, __reg))
+
+// Dual group - master and slave sequences converted at the same instant
+/* the buffer receives master and slave samples interleaved */
+# define ADC_DUAL_GROUP_COMMON                                                      \
+    .circular     = false,                                                          \
+    .end_cb       = adcCompleteCallback,                                            \
+    .error_cb     = adcErrorCallback,                                               \
+    .cfgr         = ADC_RESOLUTION,                                                 \
+    .ccr          = ADC_CCR_DUAL_REGULAR_SIMULTANEOUS,                              \
+    .tr1          = ADC_TR_DISABLED,                                                \
+    .tr2          = ADC_TR_DISABLED,                                                \
+    .tr3          = ADC_TR_DISABLED,                                                \
+    .awd2cr       = 0U,                                                             \
+    .awd3cr       = 0U,                                                             \
+    .smpr         = ADC_SMPR_ALL(ADC_SAMPLING_TIME),                                \
+    .ssmpr        = ADC_SMPR_ALL(ADC_SAMPLING_TIME)
+
+# define ADC_DUAL_MASTER(__adc) (((((__adc) - 1) / 2) * 2) + 1)
+# define ADC_DUAL_OTHER(__adc)  ((((__adc) - 1) ^ 1) + 1)
+
+// Group of a pair when none of its direct pins are selected
+# define ADC_DUAL_GROUP(__layout, __dlayout, __pair) \
+    ADC_DUAL_GROUP_LENGTH(__layout, (__pair) * 2 + 1, ADC_BUFFER_LENGTH(__layout, __dlayout, __pair))
+# define ADC_DUAL_GROUP_LENGTH(__layout, __master, __length)                       \
+{                                                                                   \
+    ADC_DUAL_GROUP_COMMON,                                                          \
+    .num_channels = 2U * (__length) * ADC_SAMPLES_PER_COLUMN,                       \
+    .sqr          = {                                                               \
+        ADC_SQR_DUAL(__layout, __master, __length, 0U),                             \
+        ADC_SQR_DUAL(__layout, __master, __length, 1U),                             \
+        ADC_SQR_DUAL(__layout, __master, __length, 2U),                             \
+        ADC_SQR_DUAL(__layout, __master, __length, 3U),                             \
+    },                                                                              \
+    .ssqr         = {                                                               \
+        ADC_SQR_DUAL(__layout, (__master) + 1, __length, 0U),                       \
+        ADC_SQR_DUAL(__layout, (__master) + 1, __length, 1U),                       \
+        ADC_SQR_DUAL(__layout, (__master) + 1, __length, 2U),                       \
+        ADC_SQR_DUAL(__layout, (__master) + 1, __length, 3U),                       \
+    }                                                                               \
+}
+
+// Group of a pair with one direct pin selected, placed at the column of the pin
+/* the other ADC of the pair can't have direct pins, so the pair is as long as its multiplexers */
+# define ADC_DUAL_DIRECT_GROUP_ENTRY(__layout, __adcn, __channel, __row, __col)    \
+[__col] = ADC_DUAL_DIRECT_GROUP(__layout, __adcn, __channel,                        \
+    ADC_MAX(1, ADC_MUX_COUNT(__layout, ADC_DUAL_OTHER(__adcn)))),
+# define ADC_DUAL_DIRECT_GROUP(__layout, __adcn, __channel, __length)              \
+{                                                                                   \
+    ADC_DUAL_GROUP_COMMON,                                                          \
+    .num_channels = 2U * (__length) * ADC_SAMPLES_PER_COLUMN,                       \
+    .sqr          = {                                                               \
+        ADC_SQR_DUAL_DIRECT(__layout, ADC_DUAL_MASTER(__adcn), __adcn, __channel, __length, 0U), \
+        ADC_SQR_DUAL_DIRECT(__layout, ADC_DUAL_MASTER(__adcn), __adcn, __channel, __length, 1U), \
+        ADC_SQR_DUAL_DIRECT(__layout, ADC_DUAL_MASTER(__adcn), __adcn, __channel, __length, 2U), \
+        ADC_SQR_DUAL_DIRECT(__layout, ADC_DUAL_MASTER(__adcn), __adcn, __channel, __length, 3U), \
+    },                                                                              \
+    .ssqr         = {                                                               \
+        ADC_SQR_DUAL_DIRECT(__layout, ADC_DUAL_MASTER(__adcn) + 1, __adcn, __channel, __length, 0U), \
+        ADC_SQR_DUAL_DIRECT(__layout, ADC_DUAL_MASTER(__adcn) + 1, __adcn, __channel, __length, 1U), \
+        ADC_SQR_DUAL_DIRECT(__layout, ADC_DUAL_MASTER(__adcn) + 1, __adcn, __channel, __length, 2U), \
+        ADC_SQR_DUAL_DIRECT(__layout, ADC_DUAL_MASTER(__adcn) + 1, __adcn, __channel, __length, 3U), \
+    }                                                                               \
+}
+
+// Group of each pair, for each hand
+/* groups with no channels are never started */
+static ADC_GROUP_CONST ADCConversionGroup adcGroups[2][N_ADC_BUFFERS] = {
+    {
+        ADC_DUAL_GROUP(ADC_LAYOUT_LEFT, ADC_DIRECT_LAYOUT_LEFT, 0),
+        ADC_DUAL_GROUP(ADC_LAYOUT_LEFT, ADC_DIRECT_LAYOUT_LEFT, 1)
     },
-    .sqr          = {
-        ADC_SQR1_SQ1_N(ADC_CHANNEL_IN3),
+    {
+        ADC_DUAL_GROUP(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 0),
+        ADC_DUAL_GROUP(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 1)
     }
 };
 
-static const ADCConversionGroup adcConversionGroup4 = { // Channel 4 only
+// Group of each direct pin (and the rest of its pair), indexed by column
+/* columns without a direct pin are left empty */
+static ADC_GROUP_CONST ADCConversionGroup adcDirectGroups[2][MATRIX_COLS] = {
+    { ADC_DIRECT_LAYOUT_LEFT(ADC_DUAL_DIRECT_GROUP_ENTRY, ADC_LAYOUT_LEFT) },
+    { ADC_DIRECT_LAYOUT_RIGHT(ADC_DUAL_DIRECT_GROUP_ENTRY, ADC_LAYOUT_RIGHT) }
+};
+#endif
+
+#ifdef ADC_DRIFT_COMPENSATION
+// Group which converts VREFINT (channel 18) and the temperature sensor (channel 16) on ADC1
+/* the temperature sensor needs a sampling time of at least 2.2us, so the longest one is used,
+in dual mode ADC2 converts padding alongside (the samples are interleaved) */
+static const ADCConversionGroup adcDriftGroup = {
     .circular     = false,
-    .num_channels = 1U,
-    .end_cb       = adcCompleteCallback,
+    .num_channels = 2U * ADC_ADCS_PER_BUFFER,
+    .end_cb       = NULL,
     .error_cb     = adcErrorCallback,
-    .cfgr         = ADC_RESOLUTION,
+    .cfgr         = ADC_CFGR_RES_12BITS,
+# ifdef ADC_DUAL_MODE
+    .ccr          = ADC_CCR_DUAL_REGULAR_SIMULTANEOUS,
+# endif
     .tr1          = ADC_TR_DISABLED,
     .tr2          = ADC_TR_DISABLED,
     .tr3          = ADC_TR_DISABLED,
     .awd2cr       = 0U,
     .awd3cr       = 0U,
-    .smpr         = {
-        ADC_SMPR1_SMP_AN4(ADC_SAMPLING_TIME),
+    .smpr         = ADC_SMPR_ALL(ADC_SMPR_SMP_601P5),
+    .sqr          = { ADC_SQR1_SQ1_N(ADC_CHANNEL_IN18) | ADC_SQR1_SQ2_N(ADC_CHANNEL_IN16), 0U, 0U, 0U },
+# ifdef ADC_DUAL_MODE
+    .ssmpr        = ADC_SMPR_ALL(ADC_SMPR_SMP_601P5),
+    .ssqr         = { ADC_SQR_FILL(0U, 0U, 2U, ADC_PADDING_CHANNEL), 0U, 0U, 0U },
+# endif
+};
+#endif
+
+// Multiplexer and rank of each row
+typedef struct {
+    uint8_t adc;  // 0 if the row isn't read through a multiplexer
+    uint8_t rank;
+} adc_row_map_t;
+#define ADC_ROW_MAP_ENTRY(__arg, __adcn, __rank, __channel, __row) [__row] = { __adcn, __rank },
+static const adc_row_map_t adc_row_map[MATRIX_ROWS] = {
+    ADC_LAYOUT_LEFT(ADC_ROW_MAP_ENTRY, 0)
+    ADC_LAYOUT_RIGHT(ADC_ROW_MAP_ENTRY, 0)
+};
+
+// Direct pin of each column
+typedef struct {
+    uint8_t adc;  // 0 if there is no direct pin on this column
+    uint8_t row;
+    uint8_t channel;
+} adc_direct_map_t;
+#define ADC_DIRECT_MAP_ENTRY(__arg, __adcn, __channel, __row, __col) [__col] = { __adcn, __row, __channel },
+static const adc_direct_map_t adc_direct_map[2][MATRIX_COLS] = {
+    { ADC_DIRECT_LAYOUT_LEFT(ADC_DIRECT_MAP_ENTRY, 0) },
+    { ADC_DIRECT_LAYOUT_RIGHT(ADC_DIRECT_MAP_ENTRY, 0) }
+};
+
+// Number of conversions per column in each buffer
+static const uint8_t adc_buffer_length[2][N_ADC_BUFFERS] = {
+    {
+        ADC_BUFFER_LENGTH(ADC_LAYOUT_LEFT, ADC_DIRECT_LAYOUT_LEFT, 0),
+        ADC_BUFFER_LENGTH(ADC_LAYOUT_LEFT, ADC_DIRECT_LAYOUT_LEFT, 1),
+#ifndef ADC_DUAL_MODE
+        ADC_BUFFER_LENGTH(ADC_LAYOUT_LEFT, ADC_DIRECT_LAYOUT_LEFT, 2),
+        ADC_BUFFER_LENGTH(ADC_LAYOUT_LEFT, ADC_DIRECT_LAYOUT_LEFT, 3)
+#endif
     },
-    .sqr          = {
-        ADC_SQR1_SQ1_N(ADC_CHANNEL_IN4),
+    {
+        ADC_BUFFER_LENGTH(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 0),
+        ADC_BUFFER_LENGTH(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 1),
+#ifndef ADC_DUAL_MODE
+        ADC_BUFFER_LENGTH(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 2),
+        ADC_BUFFER_LENGTH(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 3)
+#endif
     }
 };
 
+// ADCs which read direct pins, one bit per ADC
+#define ADC_DIRECT_MASK(__dlayout) (                \
+    ((ADC_DIRECT_COUNT(__dlayout, 1) > 0) << 0) |   \
+    ((ADC_DIRECT_COUNT(__dlayout, 2) > 0) << 1) |   \
+    ((ADC_DIRECT_COUNT(__dlayout, 3) > 0) << 2) |   \
+    ((ADC_DIRECT_COUNT(__dlayout, 4) > 0) << 3)     \
+)
+static const uint8_t adc_direct_mask[2] = {
+    ADC_DIRECT_MASK(ADC_DIRECT_LAYOUT_LEFT),
+    ADC_DIRECT_MASK(ADC_DIRECT_LAYOUT_RIGHT)
+};
+
+// Check the layout of one ADC
+#define ADC_CHECK_LAYOUT(__layout, __dlayout, __adc)                                \
+    _Static_assert(ADC_MUX_COUNT(__layout, __adc) <= MAX_MUXES_PER_ADC,             \
+        "ADC" #__adc " reads more multiplexers than MAX_MUXES_PER_ADC");            \
+    _Static_assert(ADC_SEQUENCE_LENGTH(__layout, __dlayout, __adc) * ADC_SAMPLES_PER_COLUMN <= 16, \
+        "ADC" #__adc " sequence is longer than 16 conversions");                    \
+    _Static_assert(ADC_RANK_SUM(__layout, __adc) ==                                 \
+        ADC_MUX_COUNT(__layout, __adc) * (ADC_MUX_COUNT(__layout, __adc) - 1) / 2,  \
+        "ADC" #__adc " ranks must be 0,1,2...");                                    \
+    _Static_assert(!(ADC_MUX_COUNT(__layout, __adc) && ADC_DIRECT_COUNT(__dlayout, __adc)), \
+        "ADC" #__adc " can't read multiplexers and direct pins");
+ADC_CHECK_LAYOUT(ADC_LAYOUT_LEFT,  ADC_DIRECT_LAYOUT_LEFT,  1)
+ADC_CHECK_LAYOUT(ADC_LAYOUT_LEFT,  ADC_DIRECT_LAYOUT_LEFT,  2)
+ADC_CHECK_LAYOUT(ADC_LAYOUT_LEFT,  ADC_DIRECT_LAYOUT_LEFT,  3)
+ADC_CHECK_LAYOUT(ADC_LAYOUT_LEFT,  ADC_DIRECT_LAYOUT_LEFT,  4)
+ADC_CHECK_LAYOUT(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 1)
+ADC_CHECK_LAYOUT(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 2)
+ADC_CHECK_LAYOUT(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 3)
+ADC_CHECK_LAYOUT(ADC_LAYOUT_RIGHT, ADC_DIRECT_LAYOUT_RIGHT, 4)
+#ifdef ADC_DUAL_MODE
+_Static_assert(
+    !(ADC_DIRECT_COUNT(ADC_DIRECT_LAYOUT_LEFT,  1) && ADC_DIRECT_COUNT(ADC_DIRECT_LAYOUT_LEFT,  2)) &&
+    !(ADC_DIRECT_COUNT(ADC_DIRECT_LAYOUT_LEFT,  3) && ADC_DIRECT_COUNT(ADC_DIRECT_LAYOUT_LEFT,  4)) &&
+    !(ADC_DIRECT_COUNT(ADC_DIRECT_LAYOUT_RIGHT, 1) && ADC_DIRECT_COUNT(ADC_DIRECT_LAYOUT_RIGHT, 2)) &&
+    !(ADC_DIRECT_COUNT(ADC_DIRECT_LAYOUT_RIGHT, 3) && ADC_DIRECT_COUNT(ADC_DIRECT_LAYOUT_RIGHT, 4)),
+    "Both ADCs of a dual mode pair can't have direct pins"
+);
+#endif
+#ifdef ADC_TIMER_TRIGGER
+# define ADC_DIRECT_HIGH_COL_ENTRY(__arg, __adcn, __channel, __row, __col) + ((__col) >= (MATRIX_COLS / 2))
+_Static_assert(
+    (0 ADC_DIRECT_LAYOUT_LEFT(ADC_DIRECT_HIGH_COL_ENTRY, 0)) == 0 &&
+    (0 ADC_DIRECT_LAYOUT_RIGHT(ADC_DIRECT_HIGH_COL_ENTRY, 0)) == 0,
+    "Timer triggered direct pins must be in the first half of the columns"
+);
+#endif
+
 /* Channel 5, not used in this keyboard
 static const ADCConversionGroup adcConversionGroup5 = { // Channel 5 only
     .circular     = false,
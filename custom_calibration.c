@@ -1,6 +1,8 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
 
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include "util.h"
 
@@ -10,60 +12,298 @@
 
 uint8_t analog_to_distance(uint16_t input, lookup_table_t *lut_params) {
 
-    double intermediate = (log((input - lut_params->lut_d) / lut_params->lut_a) - lut_params->lut_c) / lut_params->lut_b;
+    float intermediate = (logf((input - lut_params->lut_d) / lut_params->lut_a) - lut_params->lut_c) / lut_params->lut_b;
 
     return (uint8_t) MAX(0, MIN(intermediate, lut_params->max_output));
 }
 
 uint16_t distance_to_analog(uint8_t input, lookup_table_t *lut_params) {
 
-    double intermediate = lut_params->lut_a * exp(lut_params->lut_b * input + lut_params->lut_c) + lut_params->lut_d;
+    float intermediate = lut_params->lut_a * expf(lut_params->lut_b * input + lut_params->lut_c) + lut_params->lut_d;
 
     return (uint16_t) MAX(0, MIN(intermediate, lut_params->max_input));
 }
 
 uint16_t rest_to_absolute_change(uint16_t input, lookup_table_t *lut_params) {
 
-    double intermediate = lut_params->lut_a * exp(lut_params->lut_b * input + lut_params->lut_c) + lut_params->lut_d;
+    float intermediate = lut_params->lut_a * expf(lut_params->lut_b * input + lut_params->lut_c) + lut_params->lut_d;
 
     return (uint16_t) MAX(0, MIN(intermediate, lut_params->max_output));
 }
 
-uint16_t scale_raw_value(uint16_t raw, uint8_t rest, uint16_t *lut_multiplier){
+// Fill entries start to end - 1 of a lookup table with a * exp(b * i + c) + d, limited to max_output
+/* exp of a linear term is a geometric series, so each entry is the previous one times exp(b) */
+void generate_exponential_lut(uint16_t *lut, uint16_t start, uint16_t end, lookup_table_t *lut_params) {
 
-    // Limit to be less than ANALOG_CAL_MAX_VALUE
-    return (uint16_t) MIN(ANALOG_CAL_MAX_VALUE, 
-        // Scale raw value between 0 and ANALOG_CAL_MAX_VALUE (cast to uint32_t to prevent overflows)
-        (uint32_t) ((raw < rest) ? 0 : (raw - rest)) * ANALOG_CAL_MAX_VALUE / lut_multiplier[rest]
+    const float ratio = expf(lut_params->lut_b);
+    float term = lut_params->lut_a * expf(lut_params->lut_b * start + lut_params->lut_c);
+
+    for (uint16_t i = start; i < end; i++){
+        float intermediate = term + lut_params->lut_d;
+        lut[i] = (uint16_t) MAX(0, MIN(intermediate, lut_params->max_output));
+        term *= ratio;
+    }
+}
+
+// Fill entries start to end - 1 of a lookup table with the inverse, (log((i - d) / a) - c) / b, limited to max_output
+/* with a and b positive the inverse is increasing, so the table is filled by walking the inputs
+a * exp(b * k + c) + d where it reaches each distance k - again a geometric series,
+which resumes from the entry before start */
+void generate_logarithmic_lut(uint8_t *lut, uint16_t start, uint16_t end, lookup_table_t *lut_params) {
+
+    if (lut_params->lut_a <= 0 || lut_params->lut_b <= 0){
+        for (uint16_t i = start; i < end; i++){
+            lut[i] = analog_to_distance(i, lut_params);
+        }
+        return;
+    }
+
+    const float ratio = expf(lut_params->lut_b);
+    const uint16_t max_distance = MIN(lut_params->max_output, UINT8_MAX);
+    uint16_t distance = (start == 0) ? 0 : lut[start - 1];
+    // input where the next distance is reached, without d
+    float term = lut_params->lut_a * expf(lut_params->lut_b * (distance + 1) + lut_params->lut_c);
+
+    for (uint16_t i = start; i < end; i++){
+        while (distance < max_distance && term + lut_params->lut_d <= i){
+            distance++;
+            term *= ratio;
+        }
+        lut[i] = (uint8_t) distance;
+    }
+}
+
+// Fill entries start to end - 1 of a lookup table with ANALOG_CAL_MAX_VALUE / multiplier (Q16), 0 where the multiplier is 0
+/* scaling a change from rest is then a multiply and a shift instead of a divide */
+void generate_reciprocal_lut(uint32_t *lut, const uint16_t *lut_multiplier, uint16_t start, uint16_t end) {
+
+    for (uint16_t i = start; i < end; i++){
+        lut[i] = (lut_multiplier[i] == 0) ? 0 : (((uint32_t) ANALOG_CAL_MAX_VALUE << 16) / lut_multiplier[i]);
+    }
+}
+
+// Check the coefficients of a lookup table before it is generated
+/* the coefficients must be finite and max_output must fit the table, the displacement curve
+must also be increasing (a and b with the same sign) */
+bool validate_lut_params(lookup_table_t *lut_params, uint16_t max_output_limit, bool increasing) {
+
+    if (
+        !isfinite(lut_params->lut_a) || !isfinite(lut_params->lut_b) ||
+        !isfinite(lut_params->lut_c) || !isfinite(lut_params->lut_d)
+    )
+    {
+        return false;
+    }
+    if (lut_params->max_input == 0 || lut_params->max_output == 0 || lut_params->max_output > max_output_limit){
+        return false;
+    }
+    if (increasing && !(lut_params->lut_a * lut_params->lut_b > 0)){
+        return false;
+    }
+    return true;
+}
+
+// Process every row of a column: polarity fold, calibration and lookup table
+/* folded receives the raw value after the polarity fold (used to save rest values),
+displacement the output of the lookup table, gain scales the change from rest (Q12)
+and scale is the travel of each key fused with the shared curve (Q16) */
+#if defined(__ARM_FEATURE_DSP) && (ROWS_PER_HAND % 2 == 0)
+// two 16-bit lanes with the same value
+#    define PAIR(__value) ((uint32_t)(__value) * 0x00010001U)
+
+// a - b in the lanes where a >= b, the lane of other where a < b
+/* SEL reads the GE flags set by USUB16, the compiler doesn't know about them as separate intrinsics
+and anything scheduled in between could change them, so both are in one asm block */
+static inline uint32_t usub16_or(uint32_t a, uint32_t b, uint32_t other){
+    uint32_t result;
+    __asm__ (
+        "usub16 %0, %1, %2\n\t"
+        "sel %0, %0, %3"
+        : "=&r" (result)
+        : "r" (a), "r" (b), "r" (other)
+        : "cc"
     );
+    return result;
 }
 
+void scale_raw_column(
+    const uint16_t raw[ROWS_PER_HAND], 
+    const uint16_t rest[ROWS_PER_HAND], 
+    const uint32_t scale[ROWS_PER_HAND], 
+    uint16_t gain, 
+    const uint8_t *lut_displacement, 
+    uint16_t folded[ROWS_PER_HAND], 
+    uint8_t displacement[ROWS_PER_HAND]
+)
+{
+    for (uint8_t i = 0; i < ROWS_PER_HAND; i += 2){
+        uint32_t raw_pair, rest_pair;
+        memcpy(&raw_pair,  &raw[i],  sizeof(uint32_t));
+        memcpy(&rest_pair, &rest[i], sizeof(uint32_t));
+
+        // account for magnet polarity, lanes above ANALOG_RAW_MAX_VALUE count up from it
+        uint32_t below = __USUB16(PAIR(ANALOG_RAW_MAX_VALUE), raw_pair);
+        uint32_t folded_pair = usub16_or(raw_pair, PAIR(ANALOG_RAW_MAX_VALUE + 1), below);
+
+        // subtract the rest value, lanes below rest become zero
+        uint32_t change_pair = usub16_or(folded_pair, rest_pair, 0U);
+
+        memcpy(&folded[i], &folded_pair, sizeof(uint32_t));
+
+        // apply the gain, scale between 0 and ANALOG_CAL_MAX_VALUE, then run the lookup table
+        for (uint8_t k = 0; k < 2; k++){
+            uint32_t change = ((((change_pair >> (16 * k)) & 0xFFFFU) * gain) >> 12);
+            uint32_t calibrated = (uint32_t) (((uint64_t) change * scale[i + k]) >> 16);
+            displacement[i + k] = lut_displacement[MIN(calibrated, ANALOG_CAL_MAX_VALUE)];
+        }
+    }
+}
+#else
+void scale_raw_column(
+    const uint16_t raw[ROWS_PER_HAND], 
+    const uint16_t rest[ROWS_PER_HAND], 
+    const uint32_t scale[ROWS_PER_HAND], 
+    uint16_t gain, 
+    const uint8_t *lut_displacement, 
+    uint16_t folded[ROWS_PER_HAND], 
+    uint8_t displacement[ROWS_PER_HAND]
+)
+{
+    for (uint8_t i = 0; i < ROWS_PER_HAND; i++){
+        // account for magnet polarity (bipolar sensor, 12-bit reading)
+        if (raw[i] <= ANALOG_RAW_MAX_VALUE){
+            folded[i] = ANALOG_RAW_MAX_VALUE - raw[i];
+        }
+        else { // raw > ANALOG_RAW_MAX_VALUE
+            folded[i] = raw[i] - ANALOG_RAW_MAX_VALUE - 1;
+        }
+
+        // apply the gain, run calibration (output 0-1023), then the lookup table (output 0-200)
+        uint32_t change = (folded[i] < rest[i]) ? 0 : (((uint32_t) (folded[i] - rest[i]) * gain) >> 12);
+        uint32_t calibrated = (uint32_t) (((uint64_t) change * scale[i]) >> 16);
+        displacement[i] = lut_displacement[MIN(calibrated, ANALOG_CAL_MAX_VALUE)];
+    }
+}
+#endif
+
 // analog filter variables
+/* the history is a ring of the last samples for the moving average, the median keeps the last two at the start */
+#define ANALOG_FILTER_HISTORY MAX(SMA_FILTER_SIZE, 2)
+// fractional bits of the one-euro average and speed
+#define ONE_EURO_SHIFT 4
+typedef struct {
+    uint32_t state;  // running sum (SMA), average << EMA_FILTER_SHIFT (EMA) or average << ONE_EURO_SHIFT (one-euro)
+    uint16_t history[ANALOG_FILTER_HISTORY];
+    uint16_t speed;  // smoothed speed << ONE_EURO_SHIFT (one-euro)
+    uint8_t type;
+    bool primed;     // the state has been filled with a first sample
+} analog_filter_t;
+
 static uint8_t counter = 0;
-static uint16_t buffer[ROWS_PER_HAND][MATRIX_COLS][SMA_FILTER_SIZE] = { 0 };
+__attribute__((section(".ram4")))
+static analog_filter_t filters[ROWS_PER_HAND][MATRIX_COLS];
 
-uint16_t sma_filter_set(uint16_t value, uint8_t row, uint8_t col){
+// take the filter of every key on this hand from analog_config
+void analog_filter_load(void){
+    const uint8_t row_offset = is_keyboard_left() ? 0 : ROWS_PER_HAND;
+    for (uint8_t row = 0; row < ROWS_PER_HAND; row++){
+        for (uint8_t col = 0; col < MATRIX_COLS; col++){
+            uint8_t type = analog_config[row + row_offset][col].filter;
+            filters[row][col].type = (type < ANALOG_FILTER_COUNT) ? type : ANALOG_FILTER_DEFAULT;
+            filters[row][col].primed = false;
+        }
+    }
+}
 
-    buffer[row][col][counter] = value;
+// fill the state of a filter as if every previous sample was value
+static void analog_filter_prime(analog_filter_t *filter, uint16_t value){
+    for (uint8_t i = 0; i < ANALOG_FILTER_HISTORY; i++){
+        filter->history[i] = value;
+    }
+    switch (filter->type){
+        case ANALOG_FILTER_EMA:
+            filter->state = (uint32_t) value << EMA_FILTER_SHIFT;
+            break;
+        case ANALOG_FILTER_ONE_EURO:
+            filter->state = (uint32_t) value << ONE_EURO_SHIFT;
+            break;
+        default:
+            filter->state = (uint32_t) value * SMA_FILTER_SIZE;
+            break;
+    }
+    filter->speed = 0;
+    filter->primed = true;
+}
 
-    return sma_filter_get(row, col);
+// filter a sample of a key (row of this hand), every filter is O(1) per sample
+uint16_t analog_filter_apply(uint16_t value, uint8_t row, uint8_t col){
 
-}
+    analog_filter_t *filter = &filters[row][col];
 
-uint16_t sma_filter_get(uint8_t row, uint8_t col){
+    if (!filter->primed){
+        analog_filter_prime(filter, value);
+    }
 
-    uint32_t sum = 0;
+    switch (filter->type){
+        case ANALOG_FILTER_SMA: {
+            // replace the oldest sample in the running sum
+            filter->state += value - filter->history[counter];
+            filter->history[counter] = value;
+            return (uint16_t) (filter->state / SMA_FILTER_SIZE);
+        }
+        case ANALOG_FILTER_EMA: {
+            // average += (value - average) / 2^EMA_FILTER_SHIFT, kept with EMA_FILTER_SHIFT fractional bits
+            filter->state += value - (filter->state >> EMA_FILTER_SHIFT);
+            return (uint16_t) (filter->state >> EMA_FILTER_SHIFT);
+        }
+        case ANALOG_FILTER_MEDIAN3: {
+            uint16_t a = filter->history[0];
+            uint16_t b = filter->history[1];
+            filter->history[1] = a;
+            filter->history[0] = value;
+            return MAX(MIN(a, b), MIN(MAX(a, b), value));
+        }
+        case ANALOG_FILTER_ONE_EURO: {
+            // distance from the average, smoothed into a speed so noise at rest doesn't open the filter
+            const int32_t average = (int32_t) filter->state;
+            const int32_t error = ((int32_t) value << ONE_EURO_SHIFT) - average;
+            filter->speed += ((abs(error) - (int32_t) filter->speed) * ONE_EURO_WEIGHT_SPEED) / 256;
+            // the weight of a new sample rises with the speed, up to following the key without smoothing
+            const int32_t weight = MIN(ONE_EURO_WEIGHT_MIN + ((ONE_EURO_BETA * (int32_t) filter->speed) >> ONE_EURO_SHIFT), 256);
+            filter->state = (uint32_t) (average + (error * weight) / 256);
+            return (uint16_t) ((filter->state + (1 << (ONE_EURO_SHIFT - 1))) >> ONE_EURO_SHIFT);
+        }
+        default:
+            return value;
+    }
+}
 
-    for (uint8_t i = 0; i < SMA_FILTER_SIZE; i++){
-        sum += buffer[row][col][i];
+// change the filter of a key (absolute row) in analog_config, and restart it if the key is on this hand
+bool analog_filter_set_type(uint8_t row, uint8_t col, uint8_t type){
+    if (row >= MATRIX_ROWS || col >= MATRIX_COLS || type >= ANALOG_FILTER_COUNT){
+        return false;
     }
+    analog_config[row][col].filter = type;
 
-    return (uint16_t) MIN(ANALOG_CAL_MAX_VALUE, (sum / SMA_FILTER_SIZE));
+    const uint8_t row_offset = is_keyboard_left() ? 0 : ROWS_PER_HAND;
+    if (row >= row_offset && row < row_offset + ROWS_PER_HAND){
+        filters[row - row_offset][col].type = type;
+        filters[row - row_offset][col].primed = false;
+    }
+    return true;
 }
 
-void sma_filter_increment_pointer(void){
+// filter of a key (absolute row)
+uint8_t analog_filter_get_type(uint8_t row, uint8_t col){
+    if (row >= MATRIX_ROWS || col >= MATRIX_COLS){
+        return ANALOG_FILTER_DEFAULT;
+    }
+    return analog_config[row][col].filter;
+}
+
+void analog_filter_increment_pointer(void){
     
     // increments by one
     counter = (counter + 1) % SMA_FILTER_SIZE;
 
-}
\ No newline at end of file
+}
@@ -1,11 +1,35 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
 #pragma once
 
+// Filters which can be applied to the samples of a key
+enum analog_filter_type {
+    ANALOG_FILTER_NONE = 0,
+    ANALOG_FILTER_SMA,      // simple moving average of SMA_FILTER_SIZE samples
+    ANALOG_FILTER_EMA,      // exponential moving average, new samples weigh 1 / 2^EMA_FILTER_SHIFT
+    ANALOG_FILTER_MEDIAN3,  // median of the last 3 samples, rejects single sample spikes
+    ANALOG_FILTER_ONE_EURO, // moving average which follows the key more closely the faster it moves
+    ANALOG_FILTER_COUNT
+};
+
 // Function prototypes
 uint8_t analog_to_distance(uint16_t adc, lookup_table_t *lut_params);
 uint16_t distance_to_analog(uint8_t distance, lookup_table_t *lut_params);
 uint16_t rest_to_absolute_change(uint16_t adc, lookup_table_t *lut_params);
-uint16_t scale_raw_value(uint16_t raw, uint8_t rest, uint16_t *lut_multiplier);
-uint16_t sma_filter_set(uint16_t value, uint8_t row, uint8_t col);
-uint16_t sma_filter_get(uint8_t row, uint8_t col);
-void sma_filter_increment_pointer();
\ No newline at end of file
+void generate_exponential_lut(uint16_t *lut, uint16_t start, uint16_t end, lookup_table_t *lut_params);
+void generate_logarithmic_lut(uint8_t *lut, uint16_t start, uint16_t end, lookup_table_t *lut_params);
+void generate_reciprocal_lut(uint32_t *lut, const uint16_t *lut_multiplier, uint16_t start, uint16_t end);
+bool validate_lut_params(lookup_table_t *lut_params, uint16_t max_output_limit, bool increasing);
+void scale_raw_column(
+    const uint16_t raw[ROWS_PER_HAND], 
+    const uint16_t rest[ROWS_PER_HAND], 
+    const uint32_t scale[ROWS_PER_HAND], 
+    uint16_t gain, 
+    const uint8_t *lut_displacement, 
+    uint16_t folded[ROWS_PER_HAND], 
+    uint8_t displacement[ROWS_PER_HAND]
+);
+void analog_filter_load(void);
+uint16_t analog_filter_apply(uint16_t value, uint8_t row, uint8_t col);
+bool analog_filter_set_type(uint8_t row, uint8_t col, uint8_t type);
+uint8_t analog_filter_get_type(uint8_t row, uint8_t col);
+void analog_filter_increment_pointer(void);
\ No newline at end of file
@@ -35,8 +35,17 @@ SPLIT_MUTABLE_COL pin_t col_pins[MATRIX_COLS]   = MATRIX_COL_PINS;
 #    endif // MATRIX_COL_PINS
 #endif
 
-// row offset
-static uint8_t row_offset = 0;
+// frame kernel of each hand, the one of this hand is bound in matrix_init_custom
+static void analog_process_frame_left(matrix_row_t current_matrix[], const adc_frame_t *frame);
+static void analog_process_frame_right(matrix_row_t current_matrix[], const adc_frame_t *frame);
+static void (*analog_process_frame)(matrix_row_t current_matrix[], const adc_frame_t *frame) = analog_process_frame_left;
+
+// the frame being processed, the following frame is captured while this one is processed
+static adc_frame_t scan_frame;
+
+// whether every key of this hand was at rest in the last frame which was processed
+/* quiet frames are skipped and keep it, they only happen while every key is at rest */
+static bool keys_at_rest = false;
 
 // Create array for custom matrix mask
 static const matrix_row_t custom_matrix_mask[MATRIX_ROWS] = CUSTOM_MATRIX_MASK;
@@ -49,35 +58,271 @@ analog_config_t analog_config[MATRIX_ROWS][MATRIX_COLS] = { 0 };
 __attribute__((section(".ram0")))
 static_config_t static_config = { 0 };
 
-// Declare lookup tables in core-coupled memory (ram4)
-__attribute__((section(".ram4")))
-static uint8_t lut_displacement[ANALOG_CAL_MAX_VALUE+1]    = { 0 };
+// One set of lookup tables
+typedef struct {
+    uint8_t  displacement[ANALOG_CAL_MAX_VALUE+1];
+    uint16_t multiplier[ANALOG_MULTIPLIER_LUT_SIZE];
+    uint32_t reciprocal[ANALOG_MULTIPLIER_LUT_SIZE];
+} lut_bank_t; // 4 kB
+
+// Declare lookup tables, the scan reads the front bank while a committed curve is built in the back bank
+/* core-coupled memory (ram4) can't hold both banks next to the filters, so the second bank is in ram0 */
 __attribute__((section(".ram4")))
-static uint16_t lut_multiplier[ANALOG_MULTIPLIER_LUT_SIZE] = { 0 };
+static lut_bank_t lut_bank_ccm = { 0 };
+__attribute__((section(".ram0")))
+static lut_bank_t lut_bank_sram = { 0 };
+static lut_bank_t *lut_front = &lut_bank_ccm;
+static lut_bank_t *lut_back  = &lut_bank_sram;
+
+// Coefficients edited over vial, the ones last committed, and the ones the front bank was built from
+/* static_config keeps the saved coefficients, so saving another part of it never saves a commit which wasn't */
+lookup_table_pair_t lut_staged = { 0 };
+static lookup_table_pair_t lut_committed = { 0 };
+static lookup_table_pair_t lut_live = { 0 };
+
+// Rebuild of the back bank, a slice per housekeeping task
+enum lut_rebuild_stage {
+    LUT_REBUILD_IDLE = 0,
+    LUT_REBUILD_MULTIPLIER,
+    LUT_REBUILD_RECIPROCAL,
+    LUT_REBUILD_DISPLACEMENT,
+    LUT_REBUILD_SWAP,
+    LUT_REBUILD_SAVE,
+};
+/* the scan (which may be its own thread) only reads it, and swaps the banks in LUT_REBUILD_SWAP */
+static volatile uint8_t lut_rebuild_stage = LUT_REBUILD_IDLE;
+static uint16_t lut_rebuild_position = 0;
+static bool lut_rebuild_save = false;
 
 // Create global joystick variables
 #ifdef ANALOG_KEY_VIRTUAL_AXES
 uint8_t virtual_axes_toggle = 0;
 uint8_t virtual_axes_from_self[4][4]  = { 0 };
 uint8_t virtual_axes_from_slave[4][4] = { 0 };
+// sum of the virtual axes of the frame being processed
+static uint8_t virtual_axes_temp[4][4] = { 0 };
+#endif
+
+#ifdef DEBUG_MATRIX_SCAN_RATE
+// time spent processing the last frame, and frames which were never processed
+uint32_t frame_processing_time_us = 0;
+#    ifdef ADC_FREE_RUNNING
+uint32_t frames_dropped = 0;
+#    endif
 #endif
 
 
 
 // Generate lookup tables
+/* at once into the front bank, while the keyboard starts or static_config is read */
 void generate_lookup_tables(void){
 
-    for (uint16_t i = 0; i < ANALOG_MULTIPLIER_LUT_SIZE; i++){
-        // rest -> fully pressed value
-        lut_multiplier[i] = rest_to_absolute_change(i, &static_config.multiplier);
+    // rest -> fully pressed value
+    generate_exponential_lut(lut_front->multiplier, 0, ANALOG_MULTIPLIER_LUT_SIZE, &static_config.multiplier);
+
+    // rest -> scale of the change from rest (Q16)
+    generate_reciprocal_lut(lut_front->reciprocal, lut_front->multiplier, 0, ANALOG_MULTIPLIER_LUT_SIZE);
+
+    // change in voltage from rest -> distance pressed
+    generate_logarithmic_lut(lut_front->displacement, 0, ANALOG_CAL_MAX_VALUE+1, &static_config.displacement);
+
+    // the scale of every key follows the reciprocals
+    analog_travel_load();
+
+    // nothing is staged, and a rebuild would be of older coefficients
+    lut_live.displacement = static_config.displacement;
+    lut_live.multiplier   = static_config.multiplier;
+    lut_committed = lut_live;
+    lut_staged = lut_committed;
+    lut_rebuild_stage = LUT_REBUILD_IDLE;
+
+    return;
+}
+
+// Validate the staged coefficients and rebuild the lookup tables from them
+/* returns false (and leaves the tables alone) if the coefficients are invalid,
+a commit during a rebuild starts it again with the newer coefficients */
+bool analog_lut_commit(bool save){
+    if (
+        !validate_lut_params(&lut_staged.multiplier,   ANALOG_RAW_MAX_VALUE, false) ||
+        !validate_lut_params(&lut_staged.displacement, UINT8_MAX, true)
+    )
+    {
+        return false;
     }
+    // stop a pending swap before the coefficients it would apply are replaced
+    lut_rebuild_stage = LUT_REBUILD_IDLE;
+    lut_committed = lut_staged;
+    lut_rebuild_stage = LUT_REBUILD_MULTIPLIER;
+    lut_rebuild_position = 0;
+    lut_rebuild_save |= save;
+    return true;
+}
+
+// Drop the staged coefficients which weren't committed
+void analog_lut_discard(void){
+    lut_staged = lut_committed;
+}
+
+// generate the next slice of a table, returns whether it is complete
+static bool analog_lut_slice(uint16_t size, uint16_t *start, uint16_t *end){
+    *start = lut_rebuild_position;
+    *end = MIN(lut_rebuild_position + ANALOG_LUT_SLICE, size);
+    lut_rebuild_position = (*end == size) ? 0 : *end;
+    return *end == size;
+}
+
+// Rebuild the back bank a slice at a time
+/* runs from the housekeeping task, the scan swaps the banks once the back bank is complete */
+void analog_lut_task(void){
+    uint16_t start, end;
+    switch (lut_rebuild_stage){
+        case LUT_REBUILD_MULTIPLIER:
+            if (analog_lut_slice(ANALOG_MULTIPLIER_LUT_SIZE, &start, &end)){
+                lut_rebuild_stage = LUT_REBUILD_RECIPROCAL;
+            }
+            generate_exponential_lut(lut_back->multiplier, start, end, &lut_committed.multiplier);
+            break;
+
+        case LUT_REBUILD_RECIPROCAL:
+            if (analog_lut_slice(ANALOG_MULTIPLIER_LUT_SIZE, &start, &end)){
+                lut_rebuild_stage = LUT_REBUILD_DISPLACEMENT;
+            }
+            generate_reciprocal_lut(lut_back->reciprocal, lut_back->multiplier, start, end);
+            break;
+
+        case LUT_REBUILD_DISPLACEMENT: {
+            bool complete = analog_lut_slice(ANALOG_CAL_MAX_VALUE+1, &start, &end);
+            generate_logarithmic_lut(lut_back->displacement, start, end, &lut_committed.displacement);
+            // only hand the bank over once its last slice is written
+            if (complete){
+                lut_rebuild_stage = LUT_REBUILD_SWAP;
+            }
+            break;
+        }
 
-    for (uint16_t i = 0; i < ANALOG_CAL_MAX_VALUE+1; i++){
-        // change in voltage from rest -> distance pressed
-        lut_displacement[i] = analog_to_distance(i, &static_config.displacement);
+        case LUT_REBUILD_SAVE:
+            // the scan doesn't read the coefficients of static_config, and writing the eeprom is too slow for it
+            static_config.displacement = lut_live.displacement;
+            static_config.multiplier   = lut_live.multiplier;
+            eeconfig_update_kb_datablock(&static_config);
+            lut_rebuild_save = false;
+            lut_rebuild_stage = LUT_REBUILD_IDLE;
+            break;
+
+        default:
+            break;
     }
+}
 
-    return;
+// swap a rebuilt back bank with the front bank, called by the scan between two frames
+static void analog_lut_swap(void){
+    lut_bank_t *bank = lut_front;
+    lut_front = lut_back;
+    lut_back = bank;
+    // max_output of the displacement is used by the actuation
+    lut_live = lut_committed;
+    analog_travel_load();
+    lut_rebuild_stage = lut_rebuild_save ? LUT_REBUILD_SAVE : LUT_REBUILD_IDLE;
+}
+
+// first row of this hand
+static uint8_t hand_row_offset(void){
+#ifdef SPLIT_KEYBOARD
+    if (!is_keyboard_left()){
+        return ROWS_PER_HAND;
+    }
+#endif
+    return 0;
+}
+
+// Fuse the travel of a key with the shared curve
+/* keys without a measured travel use the travel predicted from their rest value,
+so the scan only multiplies the change from rest before running the displacement table */
+static void analog_travel_update(uint8_t row, uint8_t col){
+    uint16_t travel = analog_config[row][col].travel;
+    if (travel == 0){
+        analog_key[row][col].scale = lut_front->reciprocal[MIN(analog_key[row][col].rest, ANALOG_MULTIPLIER_LUT_SIZE - 1)];
+    }
+    else {
+        analog_key[row][col].scale = ((uint32_t) ANALOG_CAL_MAX_VALUE << 16) / travel;
+    }
+}
+
+// Update the scale of every key (after the lookup tables or analog_config changed)
+void analog_travel_load(void){
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++){
+        for (uint8_t col = 0; col < MATRIX_COLS; col++){
+            analog_travel_update(row, col);
+        }
+    }
+}
+
+// Set the travel of a key, 0 goes back to the shared curve
+bool analog_travel_set(uint8_t row, uint8_t col, uint16_t travel){
+    if (row >= MATRIX_ROWS || col >= MATRIX_COLS){
+        return false;
+    }
+    analog_config[row][col].travel = travel;
+    analog_travel_update(row, col);
+    return true;
+}
+
+// whether the deepest values are captured for analog_travel_save_measured
+static bool travel_capture = false;
+
+// Start capturing the deepest value of the keys of this hand
+/* the deepest values are cleared, so only the presses made from now on are saved */
+void analog_travel_capture_start(void){
+    const uint8_t row_offset = hand_row_offset();
+    for (uint8_t row = row_offset; row < row_offset + ROWS_PER_HAND; row++){
+        for (uint8_t col = 0; col < MATRIX_COLS; col++){
+            analog_key[row][col].down = 0;
+        }
+    }
+    travel_capture = true;
+}
+
+// Set the travel between rest and the deepest value captured of the keys of this hand
+/* keys which weren't pressed, or whose travel is far from the shared curve, are left alone
+returns the number of keys which were calibrated */
+static uint8_t analog_travel_apply_captured(void){
+    const uint8_t row_offset = hand_row_offset();
+    uint8_t calibrated = 0;
+    for (uint8_t row = row_offset; row < row_offset + ROWS_PER_HAND; row++){
+        for (uint8_t col = 0; col < MATRIX_COLS; col++){
+            if (!BIT_GET(custom_matrix_mask[row], col)){
+                continue;
+            }
+            uint16_t rest = analog_key[row][col].rest;
+            uint16_t down = analog_key[row][col].down;
+            uint32_t predicted = lut_front->multiplier[MIN(rest, ANALOG_MULTIPLIER_LUT_SIZE - 1)];
+            if (down <= rest || predicted == 0){
+                continue;
+            }
+            uint32_t travel = down - rest;
+            if (
+                travel * 100 >= predicted * ANALOG_TRAVEL_MIN_PERCENT &&
+                travel * 100 <= predicted * ANALOG_TRAVEL_MAX_PERCENT
+            )
+            {
+                analog_travel_set(row, col, (uint16_t) travel);
+                calibrated++;
+            }
+        }
+    }
+    return calibrated;
+}
+
+// Finish a capture started by analog_travel_capture_start and set the travels measured in it
+/* the deepest value is kept from boot, which may hold a glitch or a press from before a magnet moved,
+so without a capture nothing is set. returns the number of keys which were calibrated */
+uint8_t analog_travel_save_measured(void){
+    if (!travel_capture){
+        return 0;
+    }
+    travel_capture = false;
+    return analog_travel_apply_captured();
 }
 
 // Initialise matrix
@@ -97,8 +342,8 @@ void matrix_init_custom(void){
             col_pins[i] = col_pins_right[i]; // col_pins is a global variable
         }
 #    endif
-        // set row offset if right hand
-        row_offset = ROWS_PER_HAND;
+        // bind the frame kernel of the right hand
+        analog_process_frame = analog_process_frame_right;
     }
 #endif
     
@@ -110,255 +355,674 @@ void matrix_init_custom(void){
     // Generate lookup tables
     generate_lookup_tables();
 
+    // Set the filter of every key (from the defaults, until analog_config is read)
+    analog_filter_load();
+
     // Initialize multiplexer GPIO pins
     multiplexer_init();
     // Initialize ADC pins
     initADCGroups();
     // Wait some time for ADCs to start
     wait_ms(100);
+#ifdef ADC_CONTINUOUS_SCAN
+    // Start continuous acquisition
+    adcStartContinuousScan();
+#else
+    // Start capturing the first frame
+    adcStartFrameCapture();
+#endif
+#ifdef ADC_RUNTIME_SAMPLING
+    // Pick the sampling time of each ADC
+    matrix_tune_sampling();
+#endif
+#ifdef ADC_CROSSTALK_COMPENSATION
+    // Measure the crosstalk at the final sampling time
+    adcCalibrateCrosstalk();
+#endif
     return;
 }
 
-// create a previous matrix
-static matrix_row_t previous_matrix[MATRIX_ROWS];
-// do a "lite" custom matrix
-bool matrix_scan_custom(matrix_row_t current_matrix[]){
-    // update previous matrix
-    memcpy(previous_matrix, current_matrix, sizeof(previous_matrix));
+#ifdef ADC_RUNTIME_SAMPLING
+// tune the sampling time of each ADC on the keys which exist
+void matrix_tune_sampling(void){
+    adcTuneSampling(custom_matrix_mask);
+}
+#endif
 
-    // store virtual axes
-    static uint8_t virtual_axes_temp[4][4] = { 0 };
+#if defined(ADC_RUNTIME_SAMPLING) || defined(ADC_CROSSTALK_COMPENSATION)
+// ADC maintenance requested over vial, enum adc_maintenance_state
+/* set to pending by the request, and only changed by matrix_adc_task once it is pending */
+#    ifdef ADC_RUNTIME_SAMPLING
+static volatile uint8_t tune_sampling_state = ADC_MAINTENANCE_IDLE;
+#    endif
+#    ifdef ADC_CROSSTALK_COMPENSATION
+static volatile uint8_t crosstalk_state = ADC_MAINTENANCE_IDLE;
+#    endif
 
-    // row, col that can be modified - static because maybe it goes faster? I honestly don't know...
-    static uint8_t row = 0;
-    static uint8_t col = 0;
-    static uint8_t next_col = 0;
+#    ifdef ADC_RUNTIME_SAMPLING
+void matrix_request_tune_sampling(void){
+    tune_sampling_state = ADC_MAINTENANCE_PENDING;
+}
 
-    // create variables to track time
-    static bool save_rest_values = false;
-    static bool time_to_be_updated = false;
-    static uint32_t time_current = 0;
-    static uint32_t time_next_calibration = 0;
-    time_current = timer_read32();
-    
-    // check if keyboard should be calibrated
-    if (time_current > time_next_calibration){
-        save_rest_values = true;
-        time_to_be_updated = true;
+uint8_t matrix_tune_sampling_state(void){
+    return tune_sampling_state;
+}
+#    endif
+
+#    ifdef ADC_CROSSTALK_COMPENSATION
+void matrix_request_crosstalk(void){
+    crosstalk_state = ADC_MAINTENANCE_PENDING;
+}
+
+uint8_t matrix_crosstalk_state(void){
+    return crosstalk_state;
+}
+#    endif
+
+// Advance the requested ADC maintenance by the last frame the scan processed
+/* runs from the housekeeping task (or the scan thread after each frame) and never waits on the ADCs,
+tuning runs before the crosstalk is measured at the final sampling time.
+both need the keys at rest, a request made while a key is pressed fails without changing anything */
+void matrix_adc_task(void){
+    static uint32_t last_sequence = 0;
+    static bool running = false;
+
+    // the scan hasn't processed a new frame since the last step
+    if (scan_frame.sequence == last_sequence){
+        return;
     }
+    last_sequence = scan_frame.sequence;
 
-    // switch multiplexer to first column
-    select_multiplexer_channel(0);
-    // start first adc scan
-    adcStartAllConversions(0);
+#    ifdef ADC_RUNTIME_SAMPLING
+    if (tune_sampling_state == ADC_MAINTENANCE_PENDING){
+        if (!running){
+            if (!keys_at_rest){
+                tune_sampling_state = ADC_MAINTENANCE_FAILED;
+                return;
+            }
+            adcTuneSamplingStart(custom_matrix_mask);
+            running = true;
+        }
+        else if (adcTuneSamplingStep(&scan_frame)){
+            tune_sampling_state = ADC_MAINTENANCE_DONE;
+            running = false;
+        }
+        return;
+    }
+#    endif
+#    ifdef ADC_CROSSTALK_COMPENSATION
+    if (crosstalk_state == ADC_MAINTENANCE_PENDING){
+        if (!running){
+            if (!keys_at_rest){
+                crosstalk_state = ADC_MAINTENANCE_FAILED;
+                return;
+            }
+            adcCrosstalkStart();
+            running = true;
+        }
+        else {
+            bool valid;
+            if (adcCrosstalkStep(&scan_frame, &valid)){
+                crosstalk_state = valid ? ADC_MAINTENANCE_DONE : ADC_MAINTENANCE_FAILED;
+                running = false;
+            }
+        }
+    }
+#    endif
+}
+#endif
 
-    // loop through columns
-    for (uint8_t current_col = 0; current_col < MATRIX_COLS; current_col++){
+#ifdef ANALOG_IDLE_SKIP
+// arm the rest windows once every key has been at rest for ANALOG_IDLE_FRAMES frames
+/* the windows cover every sample seen at rest plus a margin, keys which aren't scanned accept any value */
+static void analog_idle_update(const matrix_row_t current_matrix[], const adc_frame_t *frame, uint8_t row_offset){
+    static uint16_t rest_frames = 0;
+    static adcsample_t low[ROWS_PER_HAND][MATRIX_COLS];
+    static adcsample_t high[ROWS_PER_HAND][MATRIX_COLS];
 
-        // wait for adc to finish
-        adcWaitForConversions();
+    if (!keys_at_rest || adcIdleArmed()){
+        rest_frames = 0;
+        return;
+    }
 
-        // fetch adc values
-        static uint16_t raw_values[ROWS_PER_HAND];
+    if (rest_frames == 0){
+        memcpy(low,  frame->sample, sizeof(low));
+        memcpy(high, frame->sample, sizeof(high));
+    }
+    else {
         for (uint8_t current_row = 0; current_row < ROWS_PER_HAND; current_row++){
-            raw_values[current_row] = getADCSample(current_row + row_offset);
+            for (uint8_t col = 0; col < MATRIX_COLS; col++){
+                low[current_row][col]  = MIN(low[current_row][col],  frame->sample[current_row][col]);
+                high[current_row][col] = MAX(high[current_row][col], frame->sample[current_row][col]);
+            }
         }
+    }
+
+    rest_frames++;
+    if (rest_frames < ANALOG_IDLE_FRAMES){
+        return;
+    }
 
-        // start next adc read
-        if (current_col < MATRIX_COLS - 1){
-            // graycode the col
-            next_col = graycode_col(current_col + 1);
-            // switch multiplexer to next column
-            select_multiplexer_channel(graycoded_col);
-            // start next adc scan
-            adcStartAllConversions(graycoded_col);
+    for (uint8_t current_row = 0; current_row < ROWS_PER_HAND; current_row++){
+        for (uint8_t col = 0; col < MATRIX_COLS; col++){
+            if (BIT_GET(custom_matrix_mask[current_row + row_offset], col)){
+                low[current_row][col]  = (low[current_row][col] > ANALOG_IDLE_MARGIN) ? (low[current_row][col] - ANALOG_IDLE_MARGIN) : 0;
+                high[current_row][col] = MIN(high[current_row][col] + ANALOG_IDLE_MARGIN, UINT16_MAX);
+            }
+            else {
+                low[current_row][col]  = 0;
+                high[current_row][col] = UINT16_MAX;
+            }
         }
+    }
+    adcArmIdleWindows(low, high);
+    rest_frames = 0;
+}
+#endif
 
-        // iterate through rows
-        for (uint8_t current_row = 0; current_row < ROWS_PER_HAND; current_row++){
+// largest rise of the rest values in the frame being processed
+/* ANALOG_BASELINE_MAX_RISE for every millisecond since the previous frame, so frames
+within the same millisecond can't raise the rest value again */
+static int32_t baseline_rise = 0;
 
-            // update modifable row, col
-            row = current_row + row_offset;
-            col = graycode_col(current_col);
+// whether a key is confidently idle, so it may move its rest value
+/* it must not be actuated and be below ANALOG_BASELINE_IDLE_DISPLACEMENT and its own
+release and actuation points, a key at or below rest (displacement 0) always is */
+static inline bool analog_baseline_idle(uint8_t row, uint8_t col, uint8_t displacement, bool actuated){
+    const analog_config_t *config = &analog_config[row][col];
+    if (actuated || displacement > ANALOG_BASELINE_IDLE_DISPLACEMENT){
+        return false;
+    }
+    return displacement == 0 || (displacement < config->upper && displacement < config->lower);
+}
 
-            // if the key should be scanned
-            if (BIT_GET(custom_matrix_mask[row], col)){
-                
-                // get raw adc value
-                uint16_t raw = raw_values[current_row];
-                // run analog filter
-                raw = sma_filter_set(raw, current_row, col);
-                // account for magnet polarity (bipolar sensor, 12-bit reading)
-                if (raw <= ANALOG_RAW_MAX_VALUE){
-                    raw = ANALOG_RAW_MAX_VALUE - raw;
-                }
-                else { // raw > ANALOG_RAW_MAX_VALUE
-                    raw = raw - ANALOG_RAW_MAX_VALUE - 1;
-                }
+// move the rest value of a key to its tracked value
+static inline void analog_baseline_apply(uint8_t row, uint8_t col){
+    analog_key_t *key = &analog_key[row][col];
+
+    // round to the nearest count, the scale only changes with rest
+    uint16_t rest = (key->baseline + (1 << (ANALOG_BASELINE_SHIFT - 1))) >> ANALOG_BASELINE_SHIFT;
+    if (rest != key->rest){
+        key->rest = MIN(rest, ANALOG_MULTIPLIER_LUT_SIZE - 1);
+        // keys on the shared curve follow their rest value
+        if (analog_config[row][col].travel == 0){
+            key->scale = lut_front->reciprocal[key->rest];
+        }
+    }
+}
+
+_Static_assert(ANALOG_BASELINE_SEED_FRAMES > 0 && ANALOG_BASELINE_SEED_FRAMES <= UINT8_MAX, "ANALOG_BASELINE_SEED_FRAMES must fit the 8-bit seed count");
+
+// seed the rest value of a key from its lowest reading over ANALOG_BASELINE_SEED_FRAMES
+/* a key never reads below rest, so the lowest reading is an idle one even if the key
+is pressed for part of the window (a key held through it falls back once released) */
+static inline void analog_baseline_seed(uint8_t row, uint8_t col, uint16_t raw){
+    analog_key_t *key = &analog_key[row][col];
+    uint32_t sample = (uint32_t) MIN(raw, ANALOG_MULTIPLIER_LUT_SIZE - 1) << ANALOG_BASELINE_SHIFT;
 
-                // run calibration (output 0-1023)
-                uint16_t calibrated = scale_raw_value(raw, analog_key[row][col].rest, lut_multiplier);
+    key->baseline = (key->seed == 0) ? sample : MIN(sample, key->baseline);
+    if (++key->seed == ANALOG_BASELINE_SEED_FRAMES){
+        analog_baseline_apply(row, col);
+    }
+}
+
+// track the rest value of an idle key
+/* an exponential average, which only rises by baseline_rise per frame so a slow press
+or a held key can't drag it along, but falls freely as a key never reads below rest */
+static inline void analog_baseline_update(uint8_t row, uint8_t col, uint16_t raw){
+    analog_key_t *key = &analog_key[row][col];
+    int32_t target = (int32_t) MIN(raw, ANALOG_MULTIPLIER_LUT_SIZE - 1) << ANALOG_BASELINE_SHIFT;
+    int32_t difference = target - (int32_t) key->baseline;
+
+    // the truncated step stalls within 2^ANALOG_BASELINE_RATE of the target, so it moves at least by one
+    int32_t step = difference / (1 << ANALOG_BASELINE_RATE);
+    if (step == 0 && difference != 0){
+        step = (difference > 0) ? 1 : -1;
+    }
+    key->baseline += MIN(step, baseline_rise);
 
-                // run lookup table (output 0-200, where 200=4mm)
-                uint8_t displacement = lut_displacement[calibrated];
+    analog_baseline_apply(row, col);
+}
+
+#ifdef ANALOG_CALIBRATION_MODE
+// width of a bin of the travel profile
+# define ANALOG_CALIBRATION_PROFILE_WIDTH ((ANALOG_RAW_MAX_VALUE + 1) / ANALOG_CALIBRATION_PROFILE_BINS)
+
+// Capture of one key of this hand
+typedef struct {
+    uint16_t profile[ANALOG_CALIBRATION_PROFILE_BINS]; // frames spent in each part of the raw range while pressed
+    uint16_t bottom; // value the key is being held at near the bottom, 0 while it isn't
+    uint16_t since;  // time the key has been held there since
+    uint8_t state; // enum analog_calibration_key_state
+} calibration_key_t;
+
+__attribute__((section(".ram0")))
+static calibration_key_t calibration_keys[ROWS_PER_HAND][MATRIX_COLS] = { 0 };
+static volatile bool calibration_running = false;
+static volatile bool calibration_clear = false;
+static volatile uint8_t calibration_remaining = 0;
+static uint32_t calibration_start = 0;
 
+// Start the guided calibration of the keys of this hand
+/* every key has to be held at the bottom once and released, the keys aren't reported while it runs */
+void analog_calibration_start(void){
+    const uint8_t row_offset = hand_row_offset();
+    uint8_t remaining = 0;
+    for (uint8_t current_row = 0; current_row < ROWS_PER_HAND; current_row++){
+        for (uint8_t col = 0; col < MATRIX_COLS; col++){
+            calibration_key_t *capture = &calibration_keys[current_row][col];
+            memset(capture, 0, sizeof(calibration_key_t));
+            if (BIT_GET(custom_matrix_mask[current_row + row_offset], col)){
+                capture->state = ANALOG_CALIBRATION_KEY_WAITING;
+                // the deepest value is captured again
+                analog_key[current_row + row_offset][col].down = 0;
+                remaining++;
+            }
+        }
+    }
+    calibration_remaining = remaining;
+    calibration_start = timer_read32();
+    calibration_clear = true;
+    calibration_running = true;
+}
+
+// Release everything the keys were holding when the calibration started
+/* runs from the scan before the first frame of the calibration, as process_analog_key
+stops running actuation (and DKS) for the keys while it runs */
+static void analog_calibration_release(matrix_row_t current_matrix[]){
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++){
+        current_matrix[row] = 0;
+        for (uint8_t col = 0; col < MATRIX_COLS; col++){
+            // keys ignored for the virtual axes stay ignored
+            if (analog_key[row][col].mode != 255){
+                analog_key[row][col].mode = analog_config[row][col].mode;
+            }
+        }
+    }
+    calibration_clear = false;
+}
+
+// Capture one key of a frame while the calibration runs
+/* the rest value keeps being tracked while the key is idle, the profile counts
+the frames spent in each part of the raw range while it is pressed,
+the deepest value only counts once the key has been held at the bottom */
+static void analog_calibration_capture(matrix_row_t current_matrix[], uint8_t row, uint8_t col, uint16_t raw, uint8_t displacement){
+    calibration_key_t *capture = &calibration_keys[row % ROWS_PER_HAND][col];
+    const bool idle = analog_baseline_idle(row, col, displacement, false);
+
+    BIT_CLR(current_matrix[row], col);
+
+    if (idle){
+        analog_baseline_update(row, col, raw);
+    }
+    else {
+        uint8_t bin = MIN(raw / ANALOG_CALIBRATION_PROFILE_WIDTH, ANALOG_CALIBRATION_PROFILE_BINS - 1);
+        if (capture->profile[bin] < UINT16_MAX){
+            capture->profile[bin]++;
+        }
+    }
+
+    switch (capture->state){
+        case ANALOG_CALIBRATION_KEY_WAITING: {
+            // close to the travel predicted by the shared curve
+            uint16_t rest = analog_key[row][col].rest;
+            uint32_t change = (raw > rest) ? (raw - rest) : 0;
+            uint32_t predicted = lut_front->multiplier[MIN(rest, ANALOG_MULTIPLIER_LUT_SIZE - 1)];
+            if (change * 100 < predicted * ANALOG_CALIBRATION_BOTTOM_PERCENT){
+                capture->bottom = 0;
+            }
+            // still moving, the hold starts again
+            else if (
+                capture->bottom == 0 ||
+                raw > capture->bottom + ANALOG_CALIBRATION_BOTTOM_TOLERANCE ||
+                raw + ANALOG_CALIBRATION_BOTTOM_TOLERANCE < capture->bottom
+            )
+            {
+                capture->bottom = raw;
+                capture->since = timer_read();
+            }
+            // held at the bottom, the key has bottomed out
+            else if (timer_elapsed(capture->since) >= ANALOG_CALIBRATION_BOTTOM_HOLD_MS){
+                capture->state = ANALOG_CALIBRATION_KEY_PRESSED;
+                analog_key[row][col].down = raw;
+            }
+            break;
+        }
+        case ANALOG_CALIBRATION_KEY_PRESSED:
+            analog_key[row][col].down = MAX(raw, analog_key[row][col].down);
+            if (idle){
+                capture->state = ANALOG_CALIBRATION_KEY_DONE;
+                calibration_remaining--;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Finish the calibration once every key is done, or after ANALOG_CALIBRATION_TIMEOUT_MS
+/* runs from the housekeeping task, the travels of the keys pressed fully and released are saved */
+void analog_calibration_task(void){
+    if (!calibration_running){
+        return;
+    }
+    if (calibration_remaining > 0 && timer_elapsed32(calibration_start) < ANALOG_CALIBRATION_TIMEOUT_MS){
+        return;
+    }
+    matrix_config_lock();
+    // keys which weren't released (or never bottomed out) at the timeout lose their deepest value, so they aren't saved
+    const uint8_t row_offset = hand_row_offset();
+    for (uint8_t current_row = 0; current_row < ROWS_PER_HAND; current_row++){
+        for (uint8_t col = 0; col < MATRIX_COLS; col++){
+            if (calibration_keys[current_row][col].state != ANALOG_CALIBRATION_KEY_DONE){
+                analog_key[current_row + row_offset][col].down = 0;
+            }
+        }
+    }
+    uint8_t calibrated = analog_travel_apply_captured();
+    calibration_running = false;
+    matrix_config_unlock();
+    if (calibrated > 0){
+        eeconfig_update_user_datablock(&analog_config);
+    }
+}
+
+bool analog_calibration_running(void){
+    return calibration_running;
+}
+
+uint8_t analog_calibration_remaining(void){
+    return calibration_running ? calibration_remaining : 0;
+}
+
+// State of a key, ANALOG_CALIBRATION_KEY_NONE for the keys of the other hand
+uint8_t analog_calibration_key_state(uint8_t row, uint8_t col){
+    uint8_t current_row = row - hand_row_offset();
+    if (current_row >= ROWS_PER_HAND || col >= MATRIX_COLS){
+        return ANALOG_CALIBRATION_KEY_NONE;
+    }
+    return calibration_keys[current_row][col].state;
+}
+
+// Travel profile of a key from the last calibration, NULL for the keys of the other hand
+const uint16_t *analog_calibration_profile(uint8_t row, uint8_t col){
+    uint8_t current_row = row - hand_row_offset();
+    if (current_row >= ROWS_PER_HAND || col >= MATRIX_COLS){
+        return NULL;
+    }
+    return calibration_keys[current_row][col].profile;
+}
+#endif
+
+// process one key of a frame, raw is after the polarity fold
+/* returns whether the key (or a DKS key bound to it) was actuated */
+static bool process_analog_key(matrix_row_t current_matrix[], uint8_t row, uint8_t col, uint16_t raw, uint8_t displacement){
+    bool actuated = false;
+
+    // the displacement means nothing until the rest value is seeded
+    if (analog_key[row][col].seed < ANALOG_BASELINE_SEED_FRAMES){
+        analog_baseline_seed(row, col, raw);
+        keys_at_rest = false;
+        return false;
+    }
+
+    if (displacement > ANALOG_IDLE_DISPLACEMENT){
+        keys_at_rest = false;
+    }
+
+#ifdef ANALOG_CALIBRATION_MODE
+    // keys only feed the calibration while it runs
+    if (calibration_running){
+        analog_calibration_capture(current_matrix, row, col, raw, displacement);
+        return false;
+    }
+#endif
+
+    if (
+        // run actuation
+        actuation(
+            &analog_config[row][col], 
+            &analog_key[row][col], 
+            &current_matrix[row], 
+            col,
+            displacement, 
+            lut_live.displacement.max_output
+        )
+    )
+    {
+        // update time
+        actuated = true;
+    }
+
+#ifdef DKS_ENABLE
+    // handle DKS
+    if (
+        analog_key[row][col].mode >= 10 && 
+        analog_key[row][col].mode != 255
+    )
+    {
+        // find out which key it is assigned to
+        uint8_t dks_index = analog_key[row][col].mode - 10; // index, starts at zero
+        uint8_t dks_base_col = (dks_index * 4) % MATRIX_COLS; // starting column
+        uint8_t dks_base_row = dks_index / (MATRIX_COLS / 4); // how many rows from the end
+
+#    ifdef SPLIT_KEYBOARD
+        // alternate between rows on the left and the right
+        dks_base_row = (dks_base_row / 2) + (ROWS_PER_HAND * (1 - (dks_base_row % 2)));
+#    endif
+
+        // run actuation on four keys
+        for (uint8_t k = 0; k < 4; k++){
+
+            // get dks row and column
+            uint8_t dks_row = MATRIX_ROWS - dks_base_row - 1;
+            uint8_t dks_col = dks_base_col + k;
+            
+            if (
+                // run actuation
+                actuation(
+                    &analog_config[dks_row][dks_col], 
+                    &analog_key[dks_row][dks_col], 
+                    &current_matrix[dks_row], 
+                    dks_col,
+                    displacement, 
+                    lut_live.displacement.max_output
+                )
+            )
+            {
+                // update time
+                actuated = true;
+            }
+        }
+    }
+#endif
+#ifdef ANALOG_KEY_VIRTUAL_AXES
+    // handle joystick
+    if (
+        BIT_GET(virtual_axes_toggle, va_joystick) || 
+        BIT_GET(virtual_axes_toggle, va_mouse)
+    )
+    {
+        // get value from 0 to 127 (scaled, close enough is good enough)
+        uint8_t joystick_value = (uint16_t) (
+            (displacement < static_config.virtual_axes_deadzone) ? 0 : 
+            (displacement - static_config.virtual_axes_deadzone)
+        ) * 127 / (lut_live.displacement.max_output - static_config.virtual_axes_deadzone);
+
+        // check if it is supposed to be a joystick key
+        for (uint8_t k = 0; k < 4; k++){
+#        ifdef JOYSTICK_COORDINATES     
+            if (
+                BIT_GET(virtual_axes_toggle, va_joystick)
+            )
+            {
                 if (
-                    // run actuation
-                    actuation(
-                        &analog_config[row][col], 
-                        &analog_key[row][col], 
-                        &current_matrix[row], 
-                        col,
-                        displacement, 
-                        static_config.displacement.max_output
-                    )
+                    col == static_config.joystick_left.col[k] && 
+                    row == static_config.joystick_left.col[k]
                 )
                 {
-                    // update time
-                    time_to_be_updated = true;
+                    virtual_axes_temp[0][k] += joystick_value;
                 }
-
-#            ifdef DKS_ENABLE
-                // handle DKS
                 if (
-                    analog_key[row][col].mode >= 10 && 
-                    analog_key[row][col].mode != 255
+                    col == static_config.joystick_right.col[k] && 
+                    row == static_config.joystick_right.col[k]
                 )
                 {
-                    // find out which key it is assigned to
-                    uint8_t dks_index = analog_key[row][col].mode - 10; // index, starts at zero
-                    uint8_t dks_base_col = (dks_index * 4) % MATRIX_COLS; // starting column
-                    uint8_t dks_base_row = dks_index / (MATRIX_COLS / 4); // how many rows from the end
-
-#                ifdef SPLIT_KEYBOARD
-                    // alternate between rows on the left and the right
-                    dks_base_row = (dks_base_row / 2) + (ROWS_PER_HAND * (1 - (dks_base_row % 2)));
-#                endif
-
-                    // run actuation on four keys
-                    for (uint8_t k = 0; k < 4; k++){
-
-                        // get dks row and column
-                        static uint8_t dks_row = MATRIX_ROWS - dks_base_row - 1;
-                        static uint8_t dks_col = dks_base_col + k;
-                        
-                        if (
-                            // run actuation
-                            actuation(
-                                &analog_config[dks_row][dks_col], 
-                                &analog_key[dks_row][dks_col], 
-                                &current_matrix[dks_row], 
-                                dks_col,
-                                displacement, 
-                                static_config.displacement.max_output
-                            )
-                        )
-                        {
-                            // update time
-                            time_to_be_updated = true;
-                        }
-                    }
+                    virtual_axes_temp[1][k] += joystick_value;
                 }
-#            endif
-#            ifdef ANALOG_KEY_VIRTUAL_AXES
-                // handle joystick
+            }
+#        endif
+#        ifdef MOUSE_COORDINATES
+            if (
+                BIT_GET(virtual_axes_toggle, va_mouse)
+            )
+            {
                 if (
-                    BIT_GET(virtual_axes_toggle, va_joystick) || 
-                    BIT_GET(virtual_axes_toggle, va_mouse)
+                    col == static_config.mouse_movement.col[k] && 
+                    row == static_config.mouse_movement.row[k]
                 )
                 {
-                    // get value from 0 to 127 (scaled, close enough is good enough)
-                    uint8_t joystick_value = (uint16_t) (
-                        (displacement < static_config.virtual_axes_deadzone) ? 0 : 
-                        (displacement - static_config.virtual_axes_deadzone)
-                    ) * 127 / (static_config.displacement.max_output - static_config.virtual_axes_deadzone);
-
-                    // check if it is supposed to be a joystick key
-                    for (uint8_t k = 0; k < 4; k++){
-#                    ifdef JOYSTICK_COORDINATES     
-                        if (
-                            BIT_GET(virtual_axes_toggle, va_joystick)
-                        )
-                        {
-                            if (
-                                col == static_config.joystick_left.col[k] && 
-                                row == static_config.joystick_left.col[k]
-                            )
-                            {
-                                virtual_axes_temp[0][k] += joystick_value;
-                            }
-                            if (
-                                col == static_config.joystick_right.col[k] && 
-                                row == static_config.joystick_right.col[k]
-                            )
-                            {
-                                virtual_axes_temp[1][k] += joystick_value;
-                            }
-                        }
-#                    endif
-#                    ifdef MOUSE_COORDINATES
-                        if (
-                            BIT_GET(virtual_axes_toggle, va_mouse)
-                        )
-                        {
-                            if (
-                                col == static_config.mouse_movement.col[k] && 
-                                row == static_config.mouse_movement.row[k]
-                            )
-                            {
-                                virtual_axes_temp[2][k] += joystick_value;
-                            }
-                            if (
-                                col == static_config.mouse_scroll.col[k] && 
-                                row == static_config.mouse_scroll.row[k]
-                            )
-                            {
-                                virtual_axes_temp[3][k] += joystick_value;
-                            }
-                        }
-#                    endif
-                    }
+                    virtual_axes_temp[2][k] += joystick_value;
                 }
-#            endif
-
-                // save rest values
-                if (save_rest_values) {
-                    analog_key[row][col].rest = MIN(raw, ANALOG_MULTIPLIER_LUT_SIZE - 1);
-                }
-                
-#            ifdef DEBUG_SAVE_REST_DOWN
-                analog_key[row][col].down = MAX(raw, analog_key[row][col].down);
-#            endif
-#            ifdef DEBUG_LAST_PRESSED
                 if (
-                    row == last_pressed_row &&
-                    col == last_pressed_col
+                    col == static_config.mouse_scroll.col[k] && 
+                    row == static_config.mouse_scroll.row[k]
                 )
                 {
-                    last_pressed_value = raw;
+                    virtual_axes_temp[3][k] += joystick_value;
                 }
-#            endif
             }
+#        endif
         }
     }
+#endif
+
+    // only keys which are confidently idle move their rest value
+    if (analog_baseline_idle(row, col, displacement, actuated)){
+        analog_baseline_update(row, col, raw);
+    }
+    
+    // deepest value seen, for the travel of the key
+    analog_key[row][col].down = MAX(raw, analog_key[row][col].down);
+#ifdef DEBUG_LAST_PRESSED
+    if (
+        row == last_pressed_row &&
+        col == last_pressed_col
+    )
+    {
+        last_pressed_value = raw;
+    }
+#endif
+
+    return actuated;
+}
 
-    if (time_to_be_updated){
+// process the keys of one frame into a matrix
+/* always inlined into the kernel of each hand, so row_offset is a constant in the hot loop */
+static inline __attribute__((always_inline)) void analog_scan_keys(matrix_row_t current_matrix[], const adc_frame_t *frame, const uint8_t row_offset, const uint16_t gain){
+    keys_at_rest = true;
 
-        if (save_rest_values){
-            // next calibration in 1 minute
-            time_next_calibration = time_current + (1 * 60000);
+    // the rest values may rise once per millisecond (limited after a long pause)
+    static uint32_t baseline_time = 0;
+    const uint32_t now = timer_read32();
+    baseline_rise = (int32_t) MIN(now - baseline_time, 16) * ANALOG_BASELINE_MAX_RISE;
+    baseline_time = now;
+
+    // loop through columns
+    for (uint8_t current_col = 0; current_col < MATRIX_COLS; current_col++){
+
+        // graycode the col
+        uint8_t col = graycode_col(current_col);
+
+        // gather the column
+        uint16_t raw[ROWS_PER_HAND] __attribute__((aligned(4)));
+        uint16_t rest[ROWS_PER_HAND] __attribute__((aligned(4)));
+        uint32_t scale[ROWS_PER_HAND];
+        for (uint8_t current_row = 0; current_row < ROWS_PER_HAND; current_row++){
+            uint8_t row = current_row + row_offset;
+            raw[current_row]   = frame->sample[current_row][col];
+            rest[current_row]  = analog_key[row][col].rest;
+            scale[current_row] = analog_key[row][col].scale;
+            // run the analog filter of the key
+            if (BIT_GET(custom_matrix_mask[row], col)){
+                raw[current_row] = analog_filter_apply(raw[current_row], current_row, col);
+            }
         }
-        else {
-            // next calibration in 5 minutes
-            time_next_calibration = time_current + (5 * 60000);
+
+        // polarity fold, calibration and lookup table for the whole column
+        uint16_t folded[ROWS_PER_HAND] __attribute__((aligned(4)));
+        uint8_t displacement[ROWS_PER_HAND];
+        scale_raw_column(raw, rest, scale, gain, lut_front->displacement, folded, displacement);
+
+        // iterate through rows
+        for (uint8_t current_row = 0; current_row < ROWS_PER_HAND; current_row++){
+
+            uint8_t row = current_row + row_offset;
+
+            // if the key should be scanned
+            if (BIT_GET(custom_matrix_mask[row], col)){
+                process_analog_key(current_matrix, row, col, folded[current_row], displacement[current_row]);
+            }
         }
-        
-        // reset booleans
-        time_to_be_updated = false;
-        save_rest_values = false;
     }
 
-    sma_filter_increment_pointer();
+    // keys which are held down are never at rest
+    for (uint8_t current_row = 0; current_row < ROWS_PER_HAND; current_row++){
+        if (current_matrix[current_row + row_offset] != 0){
+            keys_at_rest = false;
+        }
+    }
+
+#ifdef ANALOG_IDLE_SKIP
+    analog_idle_update(current_matrix, frame, row_offset);
+#endif
+}
+
+// process one frame into a matrix
+/* always inlined into one kernel per hand, so row_offset is a constant in the hot loop */
+static inline __attribute__((always_inline)) void analog_process_frame_hand(matrix_row_t current_matrix[], const adc_frame_t *frame, const uint8_t row_offset){
+    // apply rebuilt lookup tables before the frame
+    if (lut_rebuild_stage == LUT_REBUILD_SWAP){
+        analog_lut_swap();
+    }
+
+#ifdef ANALOG_CALIBRATION_MODE
+    // nothing stays pressed through a calibration
+    if (calibration_clear){
+        analog_calibration_release(current_matrix);
+    }
+#endif
+
+#ifdef ADC_DRIFT_COMPENSATION
+    // the gain follows the temperature, the rest values are tracked per key
+    adc_drift_t drift;
+    adcGetDrift(&drift);
+    const uint16_t gain = drift.gain;
+#else
+    const uint16_t gain = ANALOG_GAIN_UNITY;
+#endif
+
+#ifdef DEBUG_MATRIX_SCAN_RATE
+#    ifdef ADC_FREE_RUNNING
+    // count the frames which were overwritten before they could be processed
+    static uint32_t last_sequence = 0;
+    if (last_sequence != 0){
+        frames_dropped += frame->sequence - last_sequence - 1;
+    }
+    last_sequence = frame->sequence;
+#    endif
+    rtcnt_t processing_start = chSysGetRealtimeCounterX();
+#endif
+
+#ifdef ANALOG_IDLE_SKIP
+    // nothing has moved since the rest windows were armed, only the bookkeeping of the frame runs
+    if (!frame->quiet)
+#endif
+    {
+        analog_scan_keys(current_matrix, frame, row_offset, gain);
+    }
+
+    analog_filter_increment_pointer();
 
 #ifdef ANALOG_KEY_VIRTUAL_AXES
     // copy over virtual axes
@@ -367,8 +1031,178 @@ bool matrix_scan_custom(matrix_row_t current_matrix[]){
     memset(virtual_axes_temp, 0, sizeof(virtual_axes_temp));
 #endif
 
+#ifdef DEBUG_MATRIX_SCAN_RATE
+    frame_processing_time_us = RTC2US(STM32_HCLK, chSysGetRealtimeCounterX() - processing_start);
+#endif
+
+    return;
+}
+
+static void analog_process_frame_left(matrix_row_t current_matrix[], const adc_frame_t *frame){
+    analog_process_frame_hand(current_matrix, frame, 0);
+}
+
+static void analog_process_frame_right(matrix_row_t current_matrix[], const adc_frame_t *frame){
+    analog_process_frame_hand(current_matrix, frame, ROWS_PER_HAND);
+}
+
+#ifdef ANALOG_SCAN_THREAD
+// held by the scan thread while it processes a frame
+static MUTEX_DECL(scan_config_mutex);
+#endif
+
+// Keep the scan from reading the per-key config, static_config and the lookup tables
+/* everything outside the scan which writes them holds this, so the writes land between two frames,
+without the scan thread the main loop runs the scan itself and it does nothing (not recursive) */
+void matrix_config_lock(void){
+#ifdef ANALOG_SCAN_THREAD
+    chMtxLock(&scan_config_mutex);
+#endif
+}
+
+void matrix_config_unlock(void){
+#ifdef ANALOG_SCAN_THREAD
+    chMtxUnlock(&scan_config_mutex);
+#endif
+}
+
+#ifdef ANALOG_SCAN_THREAD
+// Row changes published by the scan thread
+/* single producer (scan thread) and single consumer (matrix_scan_custom),
+each index is only written by one side so no lock is needed */
+typedef struct {
+    uint8_t row;
+    matrix_row_t value;
+} matrix_event_t;
+
+_Static_assert((ANALOG_EVENT_RING_SIZE & (ANALOG_EVENT_RING_SIZE - 1)) == 0, "ANALOG_EVENT_RING_SIZE must be a power of 2");
+_Static_assert(ANALOG_EVENT_RING_SIZE <= 128, "ANALOG_EVENT_RING_SIZE must fit the 8-bit ring indexes");
+
+static matrix_event_t matrix_events[ANALOG_EVENT_RING_SIZE];
+static volatile uint8_t matrix_event_head = 0; // written by the scan thread
+static volatile uint8_t matrix_event_tail = 0; // written by matrix_scan_custom
+
+// push a row change, returns false if the ring is full
+static bool matrix_event_push(uint8_t row, matrix_row_t value){
+    uint8_t head = matrix_event_head;
+    if ((uint8_t)(head - matrix_event_tail) >= ANALOG_EVENT_RING_SIZE){
+        return false;
+    }
+    matrix_events[head & (ANALOG_EVENT_RING_SIZE - 1)] = (matrix_event_t){ row, value };
+    // make the event visible before the index
+    __DMB();
+    matrix_event_head = head + 1;
+    return true;
+}
+
+// pop a row change, returns false if the ring is empty
+static bool matrix_event_pop(matrix_event_t *event){
+    uint8_t tail = matrix_event_tail;
+    if (tail == matrix_event_head){
+        return false;
+    }
+    __DMB();
+    *event = matrix_events[tail & (ANALOG_EVENT_RING_SIZE - 1)];
+    // finish reading the event before giving the slot back
+    __DMB();
+    matrix_event_tail = tail + 1;
+    return true;
+}
+
+static THD_WORKING_AREA(waAnalogScanThread, ANALOG_SCAN_THREAD_STACK_SIZE);
+
+#    ifdef DEBUG_MATRIX_SCAN_RATE
+// filled into the stack before the thread starts
+#        define ANALOG_SCAN_STACK_FILL 0x55
+
+// bytes of the scan thread stack which were never used
+/* the stack grows down towards the start of the working area, the thread itself is at the end */
+uint32_t matrix_scan_thread_free_stack(void){
+    const uint8_t *stack = (const uint8_t *) waAnalogScanThread;
+    uint32_t free = 0;
+    while (free < sizeof(waAnalogScanThread) && stack[free] == ANALOG_SCAN_STACK_FILL){
+        free++;
+    }
+    return free;
+}
+#    endif
+
+static THD_FUNCTION(AnalogScanThread, arg){
+    (void)arg;
+    chRegSetThreadName("analog_scan");
+
+    // matrix owned by the scan thread, and the rows the main loop has been sent
+    static matrix_row_t scan_matrix[MATRIX_ROWS];
+    static matrix_row_t published_matrix[MATRIX_ROWS];
+
+    systime_t previous = chVTGetSystemTimeX();
+    while (true){
+        systime_t next = chTimeAddX(previous, TIME_US2I(ANALOG_SCAN_THREAD_PERIOD_US));
+
+        // wait for the next frame without the lock, writes from the main loop only wait for the processing
+        adcWaitForFrame(&scan_frame);
+        chMtxLock(&scan_config_mutex);
+        analog_process_frame(scan_matrix, &scan_frame);
+        chMtxUnlock(&scan_config_mutex);
+
+#    if defined(ADC_RUNTIME_SAMPLING) || defined(ADC_CROSSTALK_COMPENSATION)
+        // tune or calibrate the ADCs when requested, a step per frame
+        matrix_adc_task();
+#    endif
+
+        // publish changed rows
+        /* if the ring is full the row is retried after the next frame */
+        for (uint8_t row = 0; row < MATRIX_ROWS; row++){
+            if (scan_matrix[row] != published_matrix[row]){
+                if (!matrix_event_push(row, scan_matrix[row])){
+                    break;
+                }
+                published_matrix[row] = scan_matrix[row];
+            }
+        }
+
+        // returns immediately if processing took longer than the period
+        previous = chThdSleepUntilWindowed(previous, next);
+    }
+}
+#endif
+
+// do a "lite" custom matrix
+bool matrix_scan_custom(matrix_row_t current_matrix[]){
+#ifdef ANALOG_SCAN_THREAD
+    // start the scan thread on the first scan (after bootmagic has read its frame)
+    static thread_t *scan_thread = NULL;
+    if (scan_thread == NULL){
+#    ifdef DEBUG_MATRIX_SCAN_RATE
+        // fill the stack, so the deepest use can be measured
+        memset(waAnalogScanThread, ANALOG_SCAN_STACK_FILL, sizeof(waAnalogScanThread));
+#    endif
+        scan_thread = chThdCreateStatic(waAnalogScanThread, sizeof(waAnalogScanThread), ANALOG_SCAN_THREAD_PRIORITY, AnalogScanThread, NULL);
+    }
+
+    // apply the row changes published since the last scan
+    bool changed = false;
+    matrix_event_t event;
+    while (matrix_event_pop(&event)){
+        if (current_matrix[event.row] != event.value){
+            current_matrix[event.row] = event.value;
+            changed = true;
+        }
+    }
+    return changed;
+#else
+    // create a previous matrix
+    static matrix_row_t previous_matrix[MATRIX_ROWS];
+    // update previous matrix
+    memcpy(previous_matrix, current_matrix, sizeof(previous_matrix));
+
+    // wait for the next frame and process it
+    adcWaitForFrame(&scan_frame);
+    analog_process_frame(current_matrix, &scan_frame);
+
     // compare current matrix against previous matrix
     return memcmp(previous_matrix, current_matrix, sizeof(previous_matrix)) != 0;
+#endif
 }
 
 
@@ -378,22 +1212,20 @@ void bootmagic_scan(void){
 
     uint16_t bootmagic_key_value = 0;
 
+    // read the key from the next frame
+    static adc_frame_t frame;
+    adcWaitForFrame(&frame);
+
 # if (defined(BOOTMAGIC_ROW) && defined(BOOTMAGIC_COLUMN))
     if (is_keyboard_left()){
-        select_multiplexer_channel(BOOTMAGIC_COLUMN);
-        adcStartAllConversions(BOOTMAGIC_COLUMN);
-        adcWaitForConversions();
-        bootmagic_key_value = getADCSample(BOOTMAGIC_ROW);
+        bootmagic_key_value = frame.sample[BOOTMAGIC_ROW][BOOTMAGIC_COLUMN];
     }
 # endif
 # if (defined(BOOTMAGIC_ROW_RIGHT) && defined(BOOTMAGIC_COLUMN_RIGHT))
     if (!is_keyboard_left()){
-        select_multiplexer_channel(BOOTMAGIC_COLUMN_RIGHT);
-        adcStartAllConversions(BOOTMAGIC_COLUMN_RIGHT);
-        adcWaitForConversions();
-        bootmagic_key_value = getADCSample(BOOTMAGIC_ROW_RIGHT);
+        bootmagic_key_value = frame.sample[BOOTMAGIC_ROW_RIGHT - ROWS_PER_HAND][BOOTMAGIC_COLUMN_RIGHT];
     }
-#endif
+# endif
 
     if (bootmagic_key_value <= ANALOG_RAW_MAX_VALUE){
         bootmagic_key_value = ANALOG_RAW_MAX_VALUE - bootmagic_key_value ;
@@ -66,8 +66,12 @@ typedef struct PACKED {
     uint8_t upper;  // deadzone
     uint8_t down;   // rapid trigger sensitivity
     uint8_t up;     // rapid trigger sensitivity
+    uint8_t filter; // filter of the samples (enum analog_filter_type)
 
-} analog_config_t; // 5 bytes
+    // Calibration of the key
+    uint16_t travel; // change from rest to bottom-out, 0 = use the shared curve
+
+} analog_config_t; // 8 bytes
 _Static_assert(sizeof(analog_config_t)*MATRIX_ROWS*MATRIX_COLS == EECONFIG_USER_DATA_SIZE, "Mismatch in user EECONFIG stored data size");
 extern analog_config_t analog_config[MATRIX_ROWS][MATRIX_COLS];
 
@@ -76,26 +80,38 @@ typedef struct {
     // Calibration settings
     uint16_t rest; // analog value when key is at rest
     uint16_t down; // analog value when key is fully pressed
+    uint32_t scale; // ANALOG_CAL_MAX_VALUE / travel (Q16), follows rest and travel
+    uint32_t baseline; // tracked rest value << ANALOG_BASELINE_SHIFT, lowest reading while seeding
 
     // Stuff that changes
     uint8_t mode;   // copy over mode from analog_config in matrix_init
     uint8_t old;    // old displacement, initialize to zero
+    uint8_t seed;   // frames seen while seeding the rest value, ANALOG_BASELINE_SEED_FRAMES once seeded
     
-} analog_key_t; // 6 bytes
+} analog_key_t; // 16 bytes
 extern analog_key_t analog_key[MATRIX_ROWS][MATRIX_COLS];
 
 typedef struct PACKED {
 
     // Get displacement from gauss
-    double lut_a;        // 8 bytes
-    double lut_b;        // 8 bytes
-    double lut_c;        // 8 bytes
-    double lut_d;        // 8 bytes
+    float lut_a;         // 4 bytes
+    float lut_b;         // 4 bytes
+    float lut_c;         // 4 bytes
+    float lut_d;         // 4 bytes
     // Define the maximum values
     uint16_t max_input;  // 2 bytes
     uint16_t max_output; // 2 bytes
 
-} lookup_table_t; // 36 bytes
+} lookup_table_t; // 20 bytes
+
+// Coefficients of the lookup tables which are staged before a commit
+typedef struct {
+
+    lookup_table_t displacement;
+    lookup_table_t multiplier;
+
+} lookup_table_pair_t;
+extern lookup_table_pair_t lut_staged;
 
 typedef struct {
 
@@ -107,8 +123,8 @@ typedef struct {
 
 typedef struct PACKED {
 
-    lookup_table_t displacement; // 36 bytes
-    lookup_table_t multiplier;   // 36 bytes
+    lookup_table_t displacement; // 20 bytes
+    lookup_table_t multiplier;   // 20 bytes
 
     virtual_axes_coordinate_t joystick_left;  // 8 bytes
     virtual_axes_coordinate_t joystick_right; // 8 bytes
@@ -116,11 +132,66 @@ typedef struct PACKED {
     virtual_axes_coordinate_t mouse_scroll;   // 8 bytes
     uint8_t virtual_axes_deadzone; // 1 byte
 
-} static_config_t; // 105 bytes
+} static_config_t; // 73 bytes
 _Static_assert(sizeof(static_config_t) == EECONFIG_KB_DATA_SIZE, "Mismatch in keyboard EECONFIG stored data size");
 extern static_config_t static_config;
 
+#ifdef ANALOG_CALIBRATION_MODE
+// State of a key during the guided calibration
+enum analog_calibration_key_state {
+    ANALOG_CALIBRATION_KEY_NONE = 0, // not calibrated (no key, or a key of the other hand)
+    ANALOG_CALIBRATION_KEY_WAITING,  // waiting to be pressed fully
+    ANALOG_CALIBRATION_KEY_PRESSED,  // pressed fully, waiting to be released
+    ANALOG_CALIBRATION_KEY_DONE,     // pressed fully and released
+};
+#endif
+
+#if defined(ADC_RUNTIME_SAMPLING) || defined(ADC_CROSSTALK_COMPENSATION)
+// State of ADC maintenance requested over vial
+/* each half keeps its own, get_adc_maintenance replies with the state of the master half */
+enum adc_maintenance_state {
+    ADC_MAINTENANCE_IDLE = 0, // never requested
+    ADC_MAINTENANCE_PENDING,  // requested or running, a step per frame
+    ADC_MAINTENANCE_DONE,     // finished
+    ADC_MAINTENANCE_FAILED,   // finished, but the result was rejected (or a key wasn't at rest)
+};
+#endif
+
 // Function prototypes
 void generate_lookup_tables(void);
+bool analog_lut_commit(bool save);
+void analog_lut_discard(void);
+void analog_lut_task(void);
+void analog_travel_load(void);
+bool analog_travel_set(uint8_t row, uint8_t col, uint16_t travel);
+void analog_travel_capture_start(void);
+uint8_t analog_travel_save_measured(void);
+#ifdef ANALOG_CALIBRATION_MODE
+void analog_calibration_start(void);
+void analog_calibration_task(void);
+bool analog_calibration_running(void);
+uint8_t analog_calibration_remaining(void);
+uint8_t analog_calibration_key_state(uint8_t row, uint8_t col);
+const uint16_t *analog_calibration_profile(uint8_t row, uint8_t col);
+#endif
 void matrix_init_custom(void);
-bool matrix_scan_custom(matrix_row_t current_matrix[]);
\ No newline at end of file
+bool matrix_scan_custom(matrix_row_t current_matrix[]);
+void matrix_config_lock(void);
+void matrix_config_unlock(void);
+#if defined(ANALOG_SCAN_THREAD) && defined(DEBUG_MATRIX_SCAN_RATE)
+uint32_t matrix_scan_thread_free_stack(void);
+#endif
+#ifdef ADC_RUNTIME_SAMPLING
+void matrix_tune_sampling(void);
+#endif
+#if defined(ADC_RUNTIME_SAMPLING) || defined(ADC_CROSSTALK_COMPENSATION)
+void matrix_adc_task(void);
+#endif
+#ifdef ADC_RUNTIME_SAMPLING
+void matrix_request_tune_sampling(void);
+uint8_t matrix_tune_sampling_state(void);
+#endif
+#ifdef ADC_CROSSTALK_COMPENSATION
+void matrix_request_crosstalk(void);
+uint8_t matrix_crosstalk_state(void);
+#endif
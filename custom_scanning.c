@@ -1,6 +1,7 @@
 /* SPDX-License-Identifier: GPL-2.0-or-later */
 
 #include <stdint.h>
+#include <string.h>
 
 #include "config.h"
 #include "custom_matrix.h"
@@ -12,6 +13,65 @@ extern SPLIT_MUTABLE_COL pin_t col_pins[MATRIX_COLS];
 // Local definitions
 static uint8_t mux_pin_count = 0;
 
+// GPIO ports of the multiplexer select pins, NULL if unused
+GPIO_TypeDef *mux_port[MUX_PORTS] = { NULL };
+// BSRR words which select each channel, one per port
+/* written with one store per port, so the select pins of a port change together */
+__attribute__((section(".ram4")))
+static uint32_t mux_bsrr[MUX_PORTS][MATRIX_COLS] = { 0 };
+
+#ifdef ADC_TIMER_TRIGGER
+// BSRR words written by DMA on every timer tick, in scan (graycoded) order
+/* DMA can't access core-coupled memory, so keep these in ram0 */
+__attribute__((section(".ram0")))
+uint32_t mux_dma_bsrr[MUX_PORTS][MATRIX_COLS] = { 0 };
+#endif
+
+_Static_assert(MATRIX_COLS == 8 || MATRIX_COLS == 16 || MATRIX_COLS == 32, "MATRIX_COLS must be 8 or 16 or 32");
+#ifndef ADC_TIMER_TRIGGER
+_Static_assert(MUX_PORTS >= MUX_SELECT_PINS, "every multiplexer select pin needs a port slot");
+#endif
+
+static void multiplexer_bsrr_init(void){
+    // start from nothing, this runs again when the pins are set up again
+    memset(mux_port, 0, sizeof(mux_port));
+    memset(mux_bsrr, 0, sizeof(mux_bsrr));
+
+    for (uint8_t i = 0; i < mux_pin_count; i++){
+        GPIO_TypeDef *port = PAL_PORT(col_pins[i]);
+        uint32_t pad = PAL_PAD(col_pins[i]);
+
+        // find which port slot this pin belongs to
+        uint8_t p = 0;
+        while (p < MUX_PORTS && mux_port[p] != NULL && mux_port[p] != port){
+            p++;
+        }
+        /* outside of timer mode every select pin has a slot, in timer mode the ports are limited
+        by the DMA streams and the pins are only known once the hand is */
+        if (p >= MUX_PORTS){
+            chSysHalt("multiplexer select pins span more ports than MUX_PORTS");
+        }
+        mux_port[p] = port;
+
+        // set or reset the pin for every channel
+        for (uint8_t channel = 0; channel < MATRIX_COLS; channel++){
+            if (channel & (1 << i)){
+                mux_bsrr[p][channel] |= (1U << pad);
+            }
+            else {
+                mux_bsrr[p][channel] |= (1U << (pad + 16));
+            }
+        }
+    }
+#ifdef ADC_TIMER_TRIGGER
+    for (uint8_t p = 0; p < MUX_PORTS; p++){
+        for (uint8_t step = 0; step < MATRIX_COLS; step++){
+            mux_dma_bsrr[p][step] = mux_bsrr[p][graycode_col(step)];
+        }
+    }
+#endif
+}
+
 void multiplexer_init(void){
     mux_pin_count = 0; // reset to zero
     for (uint8_t i = 0; i < MATRIX_COLS; i++){
@@ -20,6 +80,7 @@ void multiplexer_init(void){
             mux_pin_count += 1;
         }
     }
+    multiplexer_bsrr_init();
 }
 
 uint8_t graycode_col(uint8_t col){
@@ -27,11 +88,12 @@ uint8_t graycode_col(uint8_t col){
 }
 
 bool select_multiplexer_channel(uint8_t channel){
-    if (channel > MATRIX_COLS){
+    if (channel >= MATRIX_COLS){
         return 0;
     }
-    for (uint8_t i = 0; i < mux_pin_count; i++){
-        palWriteLine(col_pins[i], channel & (1 << i)); // gpio_write_pin(col_pins[i], channel & (1 << i));
+    // one store per port instead of one write per pin
+    for (uint8_t p = 0; p < MUX_PORTS && mux_port[p] != NULL; p++){
+        mux_port[p]->BSRR = mux_bsrr[p][channel];
     }
     return 1;
 }
@@ -3,6 +3,21 @@
 
 #include "hal.h"
 
+// Number of multiplexer select pins, the first entries of col_pins
+#define MUX_SELECT_PINS ((MATRIX_COLS > 16) ? 5 : ((MATRIX_COLS > 8) ? 4 : 3))
+// Max number of GPIO ports the multiplexer select pins can span
+/* in timer mode each port is written by its own DMA stream,
+otherwise there is a slot for every select pin so none can be left out */
+#ifdef ADC_TIMER_TRIGGER
+#    define MUX_PORTS 2
+#else
+#    define MUX_PORTS MUX_SELECT_PINS
+#endif
+extern GPIO_TypeDef *mux_port[MUX_PORTS];
+#ifdef ADC_TIMER_TRIGGER
+extern uint32_t mux_dma_bsrr[MUX_PORTS][MATRIX_COLS];
+#endif
+
 // Function prototypes
 void multiplexer_init(void);
 uint8_t graycode_col(uint8_t col);
@@ -35,6 +35,17 @@ void kb_sync_a_slave_handler(uint8_t in_buflen, const void* in_data, uint8_t out
     }
 }
 
+void kb_sync_calibration_slave_handler(uint8_t in_buflen, const void* in_data, uint8_t out_buflen, void* out_data) {
+# ifdef ANALOG_CALIBRATION_MODE
+    // start calibrating the keys of the slave
+    if (!analog_calibration_running()){
+        matrix_config_lock();
+        analog_calibration_start();
+        matrix_config_unlock();
+    }
+# endif
+}
+
 void user_sync_a_slave_handler(uint8_t in_buflen, const void* in_data, uint8_t out_buflen, void* out_data) {
     // set the virtual axes toggle
     if (in_buflen >= sizeof(uint8_t)) {
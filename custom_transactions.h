@@ -8,4 +8,5 @@
 
 // Function prototypes
 void kb_sync_a_slave_handler(uint8_t in_buflen, const void* in_data, uint8_t out_buflen, void* out_data);
+void kb_sync_calibration_slave_handler(uint8_t in_buflen, const void* in_data, uint8_t out_buflen, void* out_data);
 void user_sync_a_slave_handler(uint8_t in_buflen, const void* in_data, uint8_t out_buflen, void* out_data);
\ No newline at end of file
@@ -4,6 +4,7 @@
 
 #include "config.h"
 #include "custom_matrix.h"
+#include "custom_calibration.h"
 #include "eeconfig_set_defaults.h"
 
 // External definitions
@@ -38,6 +39,10 @@ void set_default_analog_config(void){
                 analog_config[row][col].down  = 25;
                 // 0.5 mm
                 analog_config[row][col].up    = 25;
+                // build default
+                analog_config[row][col].filter = ANALOG_FILTER_DEFAULT;
+                // use the shared curve
+                analog_config[row][col].travel = 0;
 #        ifdef DKS_ENABLE
             }
             // extra keys for DKS
@@ -52,6 +57,10 @@ void set_default_analog_config(void){
                 analog_config[row][col].down  = analog_config[row][col].lower;
                 // max travel - actuation point
                 analog_config[row][col].up    = static_config.displacement.max_output - analog_config[row][col].lower;
+                // build default
+                analog_config[row][col].filter = ANALOG_FILTER_DEFAULT;
+                // use the shared curve
+                analog_config[row][col].travel = 0;
             }
 #        endif
         }
@@ -65,8 +74,11 @@ void set_default_analog_key(void){
         for (uint8_t col = 0; col < MATRIX_COLS; col++){
             analog_key[row][col].rest = 0;
             analog_key[row][col].down = 0;
+            analog_key[row][col].scale = 0;
+            analog_key[row][col].baseline = 0;
             analog_key[row][col].mode = analog_config[row][col].mode;
             analog_key[row][col].old  = 0;
+            analog_key[row][col].seed = 0;
         }
     }
     return;
@@ -24,13 +24,13 @@ void set_default_virtual_axes(void);
 #if (EECONFIG_USER_DATA_SIZE) > 0
 # define EEPROM_USER_PARTIAL_UPDATE(__array, __row, __col) eeprom_update_block(                             \
     &(__array[__row][__col]),                                                                               \
-    (void *)((void *)(EECONFIG_USER_DATABLOCK) + sizeof(__array[0][0]) * (__row * MATRIX_COLS + __col)),    \
-    sizeof(__array)                                                                                         \
+    (void *)((void *)(EECONFIG_USER_DATABLOCK) + sizeof(__array[0][0]) * ((__row) * MATRIX_COLS + (__col))),\
+    sizeof(__array[0][0])                                                                                   \
 )
 # define EEPROM_USER_PARTIAL_READ(__array, __row, __col) eeprom_read_block(                                 \
     &(__array[__row][__col]),                                                                               \
-    (void *)((void *)(EECONFIG_USER_DATABLOCK) + sizeof(__array[0][0]) * (__row * MATRIX_COLS + __col)),    \
-    sizeof(__array)                                                                                         \
+    (void *)((void *)(EECONFIG_USER_DATABLOCK) + sizeof(__array[0][0]) * ((__row) * MATRIX_COLS + (__col))),\
+    sizeof(__array[0][0])                                                                                   \
 )
 #endif
 // https://discord.com/channels/440868230475677696/440868230475677698/1334525203044106241
@@ -11,6 +11,7 @@
 #include "config.h"
 #include "custom_matrix.h"
 #include "custom_analog.h"
+#include "custom_calibration.h"
 #include "custom_scanning.h"
 #include "custom_transactions.h"
 #include "eeconfig_set_defaults.h"
@@ -41,6 +42,12 @@ extern uint8_t last_pressed_row;
 extern uint8_t last_pressed_col;
 extern uint16_t last_pressed_value;
 #endif
+#ifdef DEBUG_MATRIX_SCAN_RATE
+extern uint32_t frame_processing_time_us;
+#    ifdef ADC_FREE_RUNNING
+extern uint32_t frames_dropped;
+#    endif
+#endif
 
 void eeconfig_init_user(void) {
     // set default values
@@ -51,8 +58,10 @@ void eeconfig_init_user(void) {
 
 void eeconfig_init_kb(void) {
     // set default values
+    matrix_config_lock();
     set_default_calibration_parameters();
     set_default_virtual_axes();
+    matrix_config_unlock();
     // write it to eeprom
     eeconfig_update_kb_datablock(&static_config);
     // call user
@@ -61,7 +70,11 @@ void eeconfig_init_kb(void) {
 
 void keyboard_post_init_user(void) {
 #if (EECONFIG_USER_DATA_SIZE) > 0
+    matrix_config_lock();
     eeconfig_read_user_datablock(&analog_config);
+    analog_filter_load();
+    analog_travel_load();
+    matrix_config_unlock();
 #endif
 #ifdef RGB_MATRIX_ENABLE
     palSetLineMode(rgb_enable_pin, PAL_MODE_OUTPUT_PUSHPULL); // gpio_set_pin_output(rgb_enable_pin);
@@ -71,11 +84,15 @@ void keyboard_post_init_user(void) {
 
 void keyboard_post_init_kb(void) {
 #if (EECONFIG_KB_DATA_SIZE) > 0
+    // the scan may already run (bootmagic scans before this)
+    matrix_config_lock();
     eeconfig_read_kb_datablock(&static_config);
     generate_lookup_tables();
+    matrix_config_unlock();
 #endif
 #ifdef SPLIT_KEYBOARD
     transaction_register_rpc(KEYBOARD_SYNC_CONFIG, kb_sync_a_slave_handler);
+    transaction_register_rpc(KEYBOARD_SYNC_CALIBRATION, kb_sync_calibration_slave_handler);
     transaction_register_rpc(USER_SYNC_JOYSTICK, user_sync_a_slave_handler);
 #endif
     // Set default state - ignore
@@ -103,6 +120,7 @@ void handle_virtual_mouse_layer(uint8_t virtual_axes_toggle){
 #if (defined(JOYSTICK_LEFT) || defined(JOYSTICK_RIGHT) || defined(MOUSE_MOVEMENT) || defined(MOUSE_SCROLL))
 void handle_virtual_axes_keys(virtual_axes_coordinate_t* coordinates, bool should_ignore){
     if (BIT_GET(virtual_axes_toggle, va_ignore_keypresses)){
+        matrix_config_lock();
         for (uint8_t i = 0; i < 4; i++){
             uint8_t row = coordinates->row[i];
             uint8_t col = coordinates->col[i];
@@ -115,6 +133,7 @@ void handle_virtual_axes_keys(virtual_axes_coordinate_t* coordinates, bool shoul
                 }
             }
         }
+        matrix_config_unlock();
     }
 }
 
@@ -235,6 +254,28 @@ bool process_record_kb(uint16_t keycode, keyrecord_t *record) {
                 }
             }
             return false;
+# endif
+# ifdef ANALOG_CALIBRATION_MODE
+        case CALIBRATE:
+            if (record->event.pressed && !analog_calibration_running()){
+                matrix_config_lock();
+                analog_calibration_start();
+                matrix_config_unlock();
+#    ifdef SPLIT_KEYBOARD
+                // the other half calibrates its own keys
+                if (is_keyboard_master()){
+                    uint8_t literally_zero = 0;
+                    transaction_rpc_exec(
+                        KEYBOARD_SYNC_CALIBRATION, 
+                        sizeof(literally_zero),
+                        &literally_zero,
+                        sizeof(literally_zero),
+                        &literally_zero
+                    );
+                }
+#    endif
+            }
+            return false;
 # endif
         default:
             return true;
@@ -244,6 +285,17 @@ bool process_record_kb(uint16_t keycode, keyrecord_t *record) {
 
 
 void housekeeping_task_kb(void) {
+    // Rebuild the lookup tables after a commit, a slice at a time
+    analog_lut_task();
+# if (defined(ADC_RUNTIME_SAMPLING) || defined(ADC_CROSSTALK_COMPENSATION)) && !defined(ANALOG_SCAN_THREAD)
+    // Tune or calibrate the ADCs when requested over vial, a frame per call (the scan thread does it after each frame)
+    matrix_adc_task();
+# endif
+# ifdef ANALOG_CALIBRATION_MODE
+    // Save the calibration once every key has been pressed
+    analog_calibration_task();
+# endif
+
 # ifdef DEBUG_LAST_PRESSED
     // Print analog value of the last pressed key
     static uint32_t last_print;
@@ -252,6 +304,22 @@ void housekeeping_task_kb(void) {
         last_print = timer_read32();
     }
 # endif
+# ifdef DEBUG_MATRIX_SCAN_RATE
+    // Print the cost of processing a frame
+    static uint32_t last_frame_print;
+    if (timer_elapsed32(last_frame_print) > 1000){ // Only print every second
+#    ifdef ADC_FREE_RUNNING
+        dprintf("frame: %4lu us, dropped: %lu\n", frame_processing_time_us, frames_dropped);
+#    else
+        // the next frame is only captured once this one is taken, so none are dropped
+        dprintf("frame: %4lu us\n", frame_processing_time_us);
+#    endif
+#    ifdef ANALOG_SCAN_THREAD
+        dprintf("scan stack: %lu bytes free\n", matrix_scan_thread_free_stack());
+#    endif
+        last_frame_print = timer_read32();
+    }
+# endif
     
 #ifdef ANALOG_KEY_VIRTUAL_AXES
     // Sync virtual axes, if enabled https://docs.qmk.fm/features/split_keyboard#custom-data-sync
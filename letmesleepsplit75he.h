@@ -17,6 +17,7 @@ enum custom_keycodes {
     M_TG_R,
     M_MO_R,
     DEBUG_REST_DOWN,
+    CALIBRATE,
 };
 /* This goes in the vial.json
 "customKeycodes": [
@@ -54,6 +55,16 @@ enum custom_keycodes {
         "name": "Analog Mouse Momentary Right",
         "title": "Momentarily use Arrow Keys to control your mouse",
         "shortName": "M_MO_R"
+    },
+    {
+        "name": "Debug Rest Down",
+        "title": "Type out the rest and down values of every key",
+        "shortName": "DEBUG_REST_DOWN"
+    },
+    {
+        "name": "Calibrate",
+        "title": "Press every key fully once to calibrate its travel",
+        "shortName": "CALIBRATE"
     }
 ],
 */
\ No newline at end of file
@@ -6,14 +6,26 @@
 #undef STM32_ADC_USE_ADC1
 #define STM32_ADC_USE_ADC1          TRUE
 
-#undef STM32_ADC_USE_ADC2
-#define STM32_ADC_USE_ADC2          TRUE
-
 #undef STM32_ADC_USE_ADC3
 #define STM32_ADC_USE_ADC3          TRUE
 
+#ifdef ADC_DUAL_MODE
+// ADC2 and ADC4 are slaves of ADC1 and ADC3, they don't have their own driver
+#undef STM32_ADC_DUAL_MODE
+#define STM32_ADC_DUAL_MODE         TRUE
+
+#undef STM32_ADC_USE_ADC2
+#define STM32_ADC_USE_ADC2          FALSE
+
+#undef STM32_ADC_USE_ADC4
+#define STM32_ADC_USE_ADC4          FALSE
+#else
+#undef STM32_ADC_USE_ADC2
+#define STM32_ADC_USE_ADC2          TRUE
+
 #undef STM32_ADC_USE_ADC4
 #define STM32_ADC_USE_ADC4          TRUE
+#endif
 
 #undef STM32_ADC_ADC1_DMA_STREAM
 #define STM32_ADC_ADC1_DMA_STREAM STM32_DMA_STREAM_ID(1, 1)
@@ -25,6 +25,41 @@ void set_virtual_axes_rgb_white(virtual_axes_coordinate_t* virtual_axes, uint8_t
     return;
 }
 
+#ifdef ANALOG_CALIBRATION_MODE
+// light every key by its calibration state: red to press fully, yellow to release, green when done
+void set_calibration_rgb(uint8_t led_min, uint8_t led_max, uint8_t brightness){
+    for (uint8_t row = 0; row < MATRIX_ROWS; row++){
+        for (uint8_t col = 0; col < MATRIX_COLS; col++){
+            uint8_t led_index = g_led_config.matrix_co[row][col];
+
+            // if there is an LED on that key
+            if (
+                led_index >= led_min && 
+                led_index < led_max && 
+                led_index != NO_LED
+            )
+            {
+                switch (analog_calibration_key_state(row, col)){
+                    case ANALOG_CALIBRATION_KEY_WAITING:
+                        RGB_MATRIX_INDICATOR_SET_COLOR(led_index, brightness, 0, 0);
+                        break;
+                    case ANALOG_CALIBRATION_KEY_PRESSED:
+                        RGB_MATRIX_INDICATOR_SET_COLOR(led_index, brightness, brightness, 0);
+                        break;
+                    case ANALOG_CALIBRATION_KEY_DONE:
+                        RGB_MATRIX_INDICATOR_SET_COLOR(led_index, 0, brightness, 0);
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+    }
+
+    return;
+}
+#endif
+
 bool rgb_matrix_indicators_advanced_kb(uint8_t led_min, uint8_t led_max) {
     // Declare variables as static
     static uint8_t brightness = 64;
@@ -32,6 +67,14 @@ bool rgb_matrix_indicators_advanced_kb(uint8_t led_min, uint8_t led_max) {
     // Get current value
     brightness = rgb_matrix_get_val();
 
+#ifdef ANALOG_CALIBRATION_MODE
+    // only show the calibration while it runs
+    if (analog_calibration_running()){
+        set_calibration_rgb(led_min, led_max, brightness);
+        return rgb_matrix_indicators_advanced_user(led_min, led_max);
+    }
+#endif
+
 #ifdef ANALOG_KEY_VIRTUAL_AXES
     for (uint8_t i = 0; i < 4; i++)
     {
@@ -5,6 +5,8 @@
 
 #include "quantum.h"
 #include "custom_matrix.h"
+#include "custom_analog.h"
+#include "custom_calibration.h"
 #include "custom_transactions.h"
 #include "via_vial_communication.h"
 
@@ -16,6 +18,34 @@ extern uint8_t virtual_axes_toggle;
 
 #if defined(VIA_ENABLE)
 
+// EEPROM writes requested by a command
+/* the commands run between two frames of the scan, the writes are done once the scan is released */
+static struct {
+    bool    user;    // all of analog_config
+    bool    key;     // analog_config of one key
+    bool    kb;      // static_config
+    uint8_t row;
+    uint8_t col;
+} pending_save;
+
+static void save_key_config(uint8_t row, uint8_t col){
+    pending_save.key = true;
+    pending_save.row = row;
+    pending_save.col = col;
+}
+
+static void save_pending_config(void){
+    if (pending_save.user){
+        eeconfig_update_user_datablock(&analog_config);
+    } else if (pending_save.key){
+        EEPROM_USER_PARTIAL_UPDATE(analog_config, pending_save.row, pending_save.col);
+    }
+    if (pending_save.kb){
+        eeconfig_update_kb_datablock(&static_config);
+    }
+    memset(&pending_save, 0, sizeof(pending_save));
+}
+
 # if defined(VIAL_ENABLE)
 
 enum letmesleep_cmd {
@@ -27,6 +57,24 @@ enum letmesleep_cmd {
     id_custom_get_virtual_axes,
     id_custom_set_virtual_axes,
     id_custom_save_virtual_axes,
+    id_custom_get_adc_sampling,
+    id_custom_set_adc_sampling,
+    id_custom_tune_adc_sampling,
+    id_custom_get_crosstalk,
+    id_custom_calibrate_crosstalk,
+    id_custom_get_adc_health,
+    id_custom_get_key_filter,
+    id_custom_set_key_filter,
+    id_custom_get_key_travel,
+    id_custom_set_key_travel,
+    id_custom_save_key_travel,
+    id_custom_commit_lut_config,
+    id_custom_discard_lut_config,
+    id_custom_start_calibration,
+    id_custom_get_calibration,
+    id_custom_get_key_profile,
+    id_custom_get_adc_maintenance,
+    id_custom_start_key_travel,
 };
 
 enum letmesleep_lut_id {
@@ -82,8 +130,7 @@ void letmesleep_set_key_config(uint8_t *data){
     analog_config[*row][*col].down  = *down;
     analog_config[*row][*col].up    = *up;
 
-    EEPROM_USER_PARTIAL_UPDATE(analog_config, *row, *col);
-    // eeconfig_update_user_datablock(&analog_config);
+    save_key_config(*row, *col);
 }
 
 void letmesleep_get_lut_config(uint8_t *data){
@@ -91,16 +138,17 @@ void letmesleep_get_lut_config(uint8_t *data){
     uint8_t *value_id   = &(data[1]);
     double  *value_data = (double *) &(data[2]);
 
+    // the staged coefficients, which are applied by a commit
     lookup_table_t *lut_config = NULL;
     switch (*lut_id) {
         case id_lut_multiplier:
-            lut_config = &static_config.multiplier;
+            lut_config = &lut_staged.multiplier;
             break;
         case id_lut_displacement:
-            lut_config = &static_config.displacement;
+            lut_config = &lut_staged.displacement;
             break;
         default:
-            break;
+            return;
     }
 
     double temp_value = 0.0;
@@ -135,16 +183,17 @@ void letmesleep_set_lut_config(uint8_t *data){
     uint8_t *value_id   = &(data[1]);
     double  *value_data = (double *) &(data[2]);
     
+    // the staged coefficients, which are applied by a commit
     lookup_table_t *lut_config = NULL;
     switch (*lut_id) {
         case id_lut_multiplier:
-            lut_config = &static_config.multiplier;
+            lut_config = &lut_staged.multiplier;
             break;
         case id_lut_displacement:
-            lut_config = &static_config.displacement;
+            lut_config = &lut_staged.displacement;
             break;
         default:
-            break;
+            return;
     }
 
     double temp_value = 0.0;
@@ -173,21 +222,22 @@ void letmesleep_set_lut_config(uint8_t *data){
     }
 }
 
+void letmesleep_commit_lut_config(uint8_t *data){
+    uint8_t *committed = &(data[0]);
+
+    // the tables are rebuilt in the background, then swapped between two scans
+    *committed = analog_lut_commit(false);
+}
+
+void letmesleep_discard_lut_config(uint8_t *data){
+    analog_lut_discard();
+}
+
 void letmesleep_save_lut_config(uint8_t *data){
-    /* for some reason the partial update doesn't work
-    uint8_t *lut_id = &(data[0]);
-    switch (*lut_id) {
-        case id_lut_multiplier:
-            EEPROM_KB_PARTIAL_UPDATE(static_config, multiplier);
-            break;
-        case id_lut_displacement:
-            EEPROM_KB_PARTIAL_UPDATE(static_config, displacement);
-            break;
-        default:
-            break;
-    }
-    */n
-    eeconfig_update_kb_datablock(&static_config);
+    uint8_t *committed = &(data[0]);
+
+    // static_config is saved once the new tables are in use
+    *committed = analog_lut_commit(true);
 }
 
 #ifdef ANALOG_KEY_VIRTUAL_AXES
@@ -266,7 +316,191 @@ void letmesleep_set_virtual_axes(uint8_t *data){
 }
 
 void letmesleep_save_virtual_axes(uint8_t *data){
-    eeconfig_update_kb_datablock(&static_config);
+    pending_save.kb = true;
+}
+
+#endif
+
+#ifdef ADC_RUNTIME_SAMPLING
+
+void letmesleep_get_adc_sampling(uint8_t *data){
+    uint8_t *adc           = &(data[0]);
+    uint8_t *sampling_time = &(data[1]);
+    uint8_t *resolution    = &(data[2]);
+    uint8_t *noise_data    = &(data[3]);
+
+    adc_sampling_t sampling = { 0 };
+    adcGetSampling(*adc, &sampling);
+
+    *sampling_time = sampling.sampling_time;
+    *resolution    = sampling.resolution;
+    memcpy(noise_data, &sampling.noise, sizeof(uint16_t));
+}
+
+void letmesleep_set_adc_sampling(uint8_t *data){
+    uint8_t *adc           = &(data[0]);
+    uint8_t *sampling_time = &(data[1]);
+    uint8_t *resolution    = &(data[2]);
+
+    adcSetSampling(*adc, *sampling_time, *resolution);
+}
+
+void letmesleep_tune_adc_sampling(uint8_t *data){
+    // tuned a frame at a time, the state is read with get_adc_maintenance
+    matrix_request_tune_sampling();
+}
+
+#endif
+
+#ifdef ADC_CROSSTALK_COMPENSATION
+
+void letmesleep_get_crosstalk(uint8_t *data){
+    uint8_t *row            = &(data[0]);
+    uint8_t *crosstalk_data = &(data[1]);
+
+    int16_t crosstalk = adcGetCrosstalk(*row);
+    memcpy(crosstalk_data, &crosstalk, sizeof(int16_t));
+}
+
+void letmesleep_calibrate_crosstalk(uint8_t *data){
+    // calibrated a frame at a time, the state is read with get_adc_maintenance
+    matrix_request_crosstalk();
+}
+
+#endif
+
+#if defined(ADC_RUNTIME_SAMPLING) || defined(ADC_CROSSTALK_COMPENSATION)
+
+void letmesleep_get_adc_maintenance(uint8_t *data){
+    uint8_t *tune_state      = &(data[0]);
+    uint8_t *crosstalk_state = &(data[1]);
+
+    // states of the master half, enum adc_maintenance_state
+    /* the slave runs the same request on its own keys, but its state isn't sent back */
+    *tune_state      = ADC_MAINTENANCE_IDLE;
+    *crosstalk_state = ADC_MAINTENANCE_IDLE;
+#    ifdef ADC_RUNTIME_SAMPLING
+    *tune_state      = matrix_tune_sampling_state();
+#    endif
+#    ifdef ADC_CROSSTALK_COMPENSATION
+    *crosstalk_state = matrix_crosstalk_state();
+#    endif
+}
+
+#endif
+
+void letmesleep_get_adc_health(uint8_t *data){
+    uint8_t *adc         = &(data[0]);
+    uint8_t *health_data = &(data[1]);
+
+    adc_health_t health = { 0 };
+    adcGetHealth(*adc, &health);
+
+    memcpy(health_data, &health, sizeof(adc_health_t));
+}
+
+void letmesleep_get_key_filter(uint8_t *data){
+    uint8_t *row    = &(data[0]);
+    uint8_t *col    = &(data[1]);
+    uint8_t *filter = &(data[2]);
+
+    *filter = analog_filter_get_type(*row, *col);
+}
+
+void letmesleep_set_key_filter(uint8_t *data){
+    uint8_t *row    = &(data[0]);
+    uint8_t *col    = &(data[1]);
+    uint8_t *filter = &(data[2]);
+
+    if (analog_filter_set_type(*row, *col, *filter)){
+        save_key_config(*row, *col);
+    }
+}
+
+void letmesleep_get_key_travel(uint8_t *data){
+    uint8_t *row         = &(data[0]);
+    uint8_t *col         = &(data[1]);
+    uint8_t *travel_data = &(data[2]);
+    uint8_t *rest_data   = &(data[4]);
+    uint8_t *down_data   = &(data[6]);
+
+    if (*row >= MATRIX_ROWS || *col >= MATRIX_COLS){
+        return;
+    }
+
+    // the travel is set on both halves, rest and down are only measured by the half of the key
+    /* the reply comes from the master, so the keys of the other half read 0 */
+    uint16_t zero = 0;
+    bool local = (*row >= ROWS_PER_HAND) != is_keyboard_left();
+#    ifndef SPLIT_KEYBOARD
+    local = true;
+#    endif
+
+    memcpy(travel_data, &analog_config[*row][*col].travel, sizeof(uint16_t));
+    memcpy(rest_data,   local ? &analog_key[*row][*col].rest : &zero, sizeof(uint16_t));
+    memcpy(down_data,   local ? &analog_key[*row][*col].down : &zero, sizeof(uint16_t));
+}
+
+void letmesleep_set_key_travel(uint8_t *data){
+    uint8_t *row         = &(data[0]);
+    uint8_t *col         = &(data[1]);
+    uint8_t *travel_data = &(data[2]);
+
+    uint16_t travel;
+    memcpy(&travel, travel_data, sizeof(uint16_t));
+
+    if (analog_travel_set(*row, *col, travel)){
+        save_key_config(*row, *col);
+    }
+}
+
+void letmesleep_start_key_travel(uint8_t *data){
+    // each half captures its own keys, until save_key_travel
+    analog_travel_capture_start();
+}
+
+void letmesleep_save_key_travel(uint8_t *data){
+    uint8_t *calibrated = &(data[0]);
+
+    // each half measures its own keys, 0 without start_key_travel
+    *calibrated = analog_travel_save_measured();
+    if (*calibrated > 0){
+        pending_save.user = true;
+    }
+}
+
+#ifdef ANALOG_CALIBRATION_MODE
+
+void letmesleep_start_calibration(uint8_t *data){
+    // each half calibrates its own keys
+    if (!analog_calibration_running()){
+        analog_calibration_start();
+    }
+}
+
+void letmesleep_get_calibration(uint8_t *data){
+    uint8_t *running   = &(data[0]);
+    uint8_t *remaining = &(data[1]);
+
+    *running   = analog_calibration_running();
+    *remaining = analog_calibration_remaining();
+}
+
+void letmesleep_get_key_profile(uint8_t *data){
+    uint8_t *row          = &(data[0]);
+    uint8_t *col          = &(data[1]);
+    uint8_t *first_bin    = &(data[2]);
+    uint8_t *profile_data = &(data[3]);
+
+    // 8 bins per request, zero for the keys of the other half
+    uint16_t bins[8] = { 0 };
+    const uint16_t *profile = analog_calibration_profile(*row, *col);
+    for (uint8_t i = 0; i < 8; i++){
+        if (profile != NULL && *first_bin + i < ANALOG_CALIBRATION_PROFILE_BINS){
+            bins[i] = profile[*first_bin + i];
+        }
+    }
+    memcpy(profile_data, bins, sizeof(bins));
 }
 
 #endif
@@ -312,6 +546,86 @@ void letmesleep_custom_command_kb(uint8_t *data, uint8_t length){
                 letmesleep_save_virtual_axes(custom_data);
                 break;
             }
+#        endif
+#        ifdef ADC_RUNTIME_SAMPLING
+            case id_custom_get_adc_sampling: {
+                letmesleep_get_adc_sampling(custom_data);
+                break;
+            }
+            case id_custom_set_adc_sampling: {
+                letmesleep_set_adc_sampling(custom_data);
+                break;
+            }
+            case id_custom_tune_adc_sampling: {
+                letmesleep_tune_adc_sampling(custom_data);
+                break;
+            }
+#        endif
+#        ifdef ADC_CROSSTALK_COMPENSATION
+            case id_custom_get_crosstalk: {
+                letmesleep_get_crosstalk(custom_data);
+                break;
+            }
+            case id_custom_calibrate_crosstalk: {
+                letmesleep_calibrate_crosstalk(custom_data);
+                break;
+            }
+#        endif
+            case id_custom_get_adc_health: {
+                letmesleep_get_adc_health(custom_data);
+                break;
+            }
+            case id_custom_get_key_filter: {
+                letmesleep_get_key_filter(custom_data);
+                break;
+            }
+            case id_custom_set_key_filter: {
+                letmesleep_set_key_filter(custom_data);
+                break;
+            }
+            case id_custom_get_key_travel: {
+                letmesleep_get_key_travel(custom_data);
+                break;
+            }
+            case id_custom_set_key_travel: {
+                letmesleep_set_key_travel(custom_data);
+                break;
+            }
+            case id_custom_start_key_travel: {
+                letmesleep_start_key_travel(custom_data);
+                break;
+            }
+            case id_custom_save_key_travel: {
+                letmesleep_save_key_travel(custom_data);
+                break;
+            }
+            case id_custom_commit_lut_config: {
+                letmesleep_commit_lut_config(custom_data);
+                break;
+            }
+            case id_custom_discard_lut_config: {
+                letmesleep_discard_lut_config(custom_data);
+                break;
+            }
+#        if defined(ADC_RUNTIME_SAMPLING) || defined(ADC_CROSSTALK_COMPENSATION)
+            case id_custom_get_adc_maintenance: {
+                letmesleep_get_adc_maintenance(custom_data);
+                break;
+            }
+#        endif
+#        ifdef ANALOG_CALIBRATION_MODE
+            case id_custom_start_calibration: {
+                letmesleep_start_calibration(custom_data);
+                break;
+            }
+            case id_custom_get_calibration: {
+                letmesleep_get_calibration(custom_data);
+                break;
+            }
+            case id_custom_get_key_profile: {
+                letmesleep_get_key_profile(custom_data);
+                break;
+            }
 #        endif
             default: {
                 /* Unhandled message */
@@ -335,8 +649,11 @@ void raw_hid_receive_kb(uint8_t *data, uint8_t length) {
     // which does not have "via_custom_value_command_kb"
     // use "id_unhandled" to invoke "letmesleep_custom_command_kb"
     if (*command_id == id_unhandled) {
-        // Process the data which was received
+        // Process the data which was received, between two frames of the scan
+        matrix_config_lock();
         letmesleep_custom_command_kb(&data[1], length - 1);
+        matrix_config_unlock();
+        save_pending_config();
         
 #    ifdef SPLIT_KEYBOARD
         if (is_keyboard_master()){
@@ -441,6 +758,8 @@ void via_custom_value_command_kb(uint8_t *data, uint8_t length){
     uint8_t *value_id_and_data = &(data[2]);
 
 	if (*channel_id == id_custom_channel) {
+        // between two frames of the scan
+        matrix_config_lock();
         switch (*command_id) {
             case id_custom_set_value: {
                 via_config_set_value(value_id_and_data);
@@ -451,7 +770,7 @@ void via_custom_value_command_kb(uint8_t *data, uint8_t length){
                 break;
             }
             case id_custom_save: {
-				eeconfig_update_user_datablock(&analog_config);
+				pending_save.user = true;
                 break;
             }
             default: {
@@ -460,6 +779,8 @@ void via_custom_value_command_kb(uint8_t *data, uint8_t length){
                 break;
             }
         }
+        matrix_config_unlock();
+        save_pending_config();
         return;
     }
 